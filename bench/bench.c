@@ -0,0 +1,264 @@
+/*
+** bench.c
+** Benchmarks of ramp generation and X requests of xsct
+** Public domain
+*/
+
+/* (X headers first, so the counting macros below do not touch them) */
+#define _POSIX_C_SOURCE 200809L
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/randr.h>
+#include <xcb/xcb.h>
+
+
+/*
+** Round-trip accounting. A blocking Xlib call is one round trip; waiting
+** for an XCB reply is one only if its request was sent after the last
+** round trip (otherwise the reply was already on its way, as with the
+** pipelined requests of xsct). Whole ramps sent and received are counted
+** as well, since they are most of the bytes on the wire.
+*/
+static struct {
+  Display *dpy;
+  unsigned long rt;       /* round trips */
+  unsigned long mark;     /* last request sent before the last round trip */
+  unsigned long nset;     /* ramps sent */
+  unsigned long nread;    /* ramps received */
+} count;
+
+static void countrt (void) {
+  count.rt++;
+  count.mark = XNextRequest(count.dpy) - 1;
+}
+
+static void countreply (unsigned int seq) {
+  if ((int)(seq - (unsigned int)count.mark) > 0) /* sent after 'mark'? */
+    countrt();
+}
+
+#define countsync(call)   (countrt(), (call))
+#define countcookie(call, ck)   (countreply((ck).sequence), (call))
+#define countramp(n, call)  ((n)++, (call))
+
+#define XRRGetScreenResourcesCurrent(d, w) \
+        countsync(XRRGetScreenResourcesCurrent(d, w))
+#define XRRQueryExtension(d, e, r)    countsync(XRRQueryExtension(d, e, r))
+#define XSync(d, b)   countsync(XSync(d, b))
+#define xcb_get_property_reply(c, ck, e) \
+        countcookie(xcb_get_property_reply(c, ck, e), ck)
+#define xcb_intern_atom_reply(c, ck, e) \
+        countcookie(xcb_intern_atom_reply(c, ck, e), ck)
+#define xcb_randr_get_crtc_info_reply(c, ck, e) \
+        countcookie(xcb_randr_get_crtc_info_reply(c, ck, e), ck)
+#define xcb_randr_get_crtc_gamma_size_reply(c, ck, e) \
+        countcookie(xcb_randr_get_crtc_gamma_size_reply(c, ck, e), ck)
+#define xcb_randr_get_crtc_gamma_reply(c, ck, e) \
+        countramp(count.nread, \
+                  countcookie(xcb_randr_get_crtc_gamma_reply(c, ck, e), ck))
+#define XRRSetCrtcGamma(d, crtc, g) \
+        countramp(count.nset, XRRSetCrtcGamma(d, crtc, g))
+
+#define main  xsct_main
+#include "xsct.c"
+#undef main
+
+
+#if defined(__AVX__)
+#define KERNEL    "avx"
+#elif defined(__SSE2__)
+#define KERNEL    "sse2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define KERNEL    "neon"
+#else
+#define KERNEL    "scalar"
+#endif
+
+#if !defined(BENCH_ITER)
+#define BENCH_ITER    20000
+#endif
+
+
+static volatile double sink; /* (keeps results alive) */
+
+
+/*
+** Nanoseconds per call of 'fillramp' for ramps of 'size' entries (of
+** 'fillpow' with the power table of exponent 'e' if not 1).
+*/
+static double benchramp (int size, double e) {
+  XRRCrtcGamma *xrr_gamma = XRRAllocGamma(size);
+  const double *pw = (e != 1.0) ? powtable(size, e) : NULL;
+  double t0;
+  int n = BENCH_ITER * 256 / size;
+  if (xrr_gamma == NULL || (e != 1.0 && pw == NULL))
+    return 0.0;
+  t0 = monotime();
+  for (int i = 0; i < n; i++) {
+    long temp = MINTEMP + 1 + i % (TEMPLUT_MAX - MINTEMP);
+    if (pw)
+      fillpow(xrr_gamma, tempgamma(temp), 1.0 - (i & 255) / 512.0, pw);
+    else
+      fillramp(xrr_gamma, tempgamma(temp), 1.0 - (i & 255) / 512.0);
+    sink += xrr_gamma->blue[size / 2];
+  }
+  t0 = monotime() - t0;
+  XRRFreeGamma(xrr_gamma);
+  return t0 * 1e9 / n;
+}
+
+
+/* nanoseconds per estimate from the end points sum (as in 'getst') */
+static double benchestimate (void) {
+  sgamma sums[256];
+  double t0;
+  for (int i = 0; i < 256; i++) { /* end points of 2 CRTCs */
+    sgamma sg = tempgamma(1000 + i * 80);
+    sums[i].red = 2.0 * floor(sg.red * BRIGHTNESS_DIV);
+    sums[i].green = 2.0 * floor(sg.green * BRIGHTNESS_DIV);
+    sums[i].blue = 2.0 * floor(sg.blue * BRIGHTNESS_DIV);
+  }
+  t0 = monotime();
+  for (int i = 0; i < BENCH_ITER * 16; i++)
+    sink += (double)gammatemp(sums[i & 255], 2).temp;
+  return (monotime() - t0) * 1e9 / (BENCH_ITER * 16);
+}
+
+
+/* nanoseconds per call of the multipliers function 'f' */
+static double benchgamma (sgamma (*f) (long)) {
+  double t0 = monotime();
+  for (int i = 0; i < BENCH_ITER * 16; i++)
+    sink += f(MINTEMP + 1 + i % (TEMPLUT_MAX - MINTEMP)).green;
+  return (monotime() - t0) * 1e9 / (BENCH_ITER * 16);
+}
+
+
+/* nanoseconds per 'collectargs' of 'argv' */
+static double benchargs (int argc, const char *const *argv) {
+  double t0 = monotime();
+  for (int i = 0; i < BENCH_ITER * 16; i++) {
+    tempstate ts = { .temp = MIN_DELTA, .brightness = MIN_DELTA };
+    sink += (double)collectargs(argc, argv, &ts) + (double)ts.temp;
+  }
+  return (monotime() - t0) * 1e9 / (BENCH_ITER * 16);
+}
+
+
+/*
+** Microseconds from exec to exit of 'xsct --help' at path 'prog' (which
+** exits before opening the display), 0.0 if it cannot be run.
+*/
+static double benchexec (const char *prog) {
+  int n = BENCH_ITER / 100;
+  double t0 = monotime();
+  for (int i = 0; i < n; i++) {
+    int status;
+    pid_t pid = fork();
+    if (pid < 0)
+      return 0.0;
+    else if (pid == 0) { /* child? */
+      int fd = open("/dev/null", O_WRONLY);
+      if (fd >= 0)
+        dup2(fd, STDOUT_FILENO);
+      execl(prog, prog, "--help", (char *)NULL);
+      _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+      return 0.0;
+  }
+  return (monotime() - t0) * 1e6 / n;
+}
+
+
+/* run 'argv' as a fresh xsct invocation and print its X costs */
+static void benchop (const char *name, int argc, const char *const *argv) {
+  tempstate ts = { .temp = MIN_DELTA, .brightness = MIN_DELTA };
+  unsigned long req;
+  unsigned flags;
+  double t0 = monotime();
+  fail = 0;
+  xa_gamma = None; /* (interned again on the new connection) */
+  xa_gammapending = 0;
+  atomic = json = force = 0;
+  ease = EASE_SMOOTH;
+  gamma_arg = 0.0;
+  crtc_arg = screen_arg = -1;
+  fade_ms = 0;
+  temp_day = TEMP_NORM;
+  temp_night = TEMP_NIGHT;
+  if ((count.dpy = XOpenDisplay(NULL)) == NULL)
+    return;
+  count.rt = 1; /* (connection setup) */
+  count.mark = XNextRequest(count.dpy) - 1;
+  count.nset = count.nread = 0;
+  req = XNextRequest(count.dpy);
+  flags = collectargs(argc, argv, &ts);
+  run(count.dpy, flags, ts);
+  runfades(count.dpy);
+  XFlush(count.dpy);
+  printf("%-8s %9lu %11lu %5lu %5lu %9.3f\n", name,
+         XNextRequest(count.dpy) - req, count.rt, count.nset, count.nread,
+         (monotime() - t0) * 1e3);
+  freeramps();
+  freectxs(count.dpy);
+  XCloseDisplay(count.dpy);
+  if (fail)
+    printf("(%s failed)\n", name);
+}
+
+
+int main (int argc, char **argv) {
+  static const char *const set[] = { "xsct", "4500" };
+  static const char *const delta[] = { "xsct", "-d", "-100", "0" };
+  static const char *const toggle[] = { "xsct", "-t" };
+  static const char *const query[] = { "xsct" };
+  static const char *const longopts[] = { "xsct", "--verbose", "--fade",
+                                          "300", "--gamma", "2.2", "--crtc",
+                                          "1" };
+  Display *dpy;
+  fout = fopen("/dev/null", "w"); /* (estimates) */
+  ferr = stderr;
+  if (fout == NULL)
+    fout = stdout;
+  printf("ramp generation (%s kernel)\n", KERNEL);
+  for (int size = 256; size <= 4096; size *= 4)
+    printf("  fillramp %4d  %10.1f ns\n", size, benchramp(size, 1.0));
+  for (int size = 256; size <= 4096; size *= 4)
+    printf("  fillpow  %4d  %10.1f ns\n", size, benchramp(size, 2.2));
+  freeramps(); /* (power tables) */
+  printf("  tempgamma      %10.1f ns\n", benchgamma(tempgamma));
+  buildtemplut();
+  printf("  lutgamma       %10.1f ns\n", benchgamma(lutgamma));
+  printf("  estimate       %10.1f ns\n", benchestimate());
+  printf("startup\n");
+  printf("  parse set      %10.1f ns\n", benchargs(2, set));
+  printf("  parse delta    %10.1f ns\n", benchargs(4, delta));
+  printf("  parse long     %10.1f ns\n", benchargs(8, longopts));
+  verbose = stats = json = force = atomic = 0; /* (set by the parses) */
+  gamma_arg = 0.0;
+  crtc_arg = screen_arg = -1;
+  fade_ms = 0;
+  if (argc > 1) /* have xsct binary? */
+    printf("  exec to exit   %10.1f us\n", benchexec(argv[1]));
+  if ((dpy = XOpenDisplay(NULL)) == NULL) {
+    printf("no X display, skipping X requests\n");
+    return EXIT_SUCCESS;
+  } else {
+    XRRScreenResources *xrr_res = XRRGetScreenResourcesCurrent(dpy,
+                                    DefaultRootWindow(dpy));
+    printf("X requests on '%s' (%d screens, %d CRTCs on screen 0)\n",
+           XDisplayString(dpy), XScreenCount(dpy), xrr_res->ncrtc);
+    XRRFreeScreenResources(xrr_res);
+    XCloseDisplay(dpy);
+  }
+  printf("%-8s %9s %11s %5s %5s %9s\n", "op", "requests", "round-trips",
+         "set", "read", "ms");
+  benchop("set", 2, set);
+  benchop("delta", 4, delta);
+  benchop("toggle", 2, toggle);
+  benchop("query", 1, query);
+  return EXIT_SUCCESS;
+}
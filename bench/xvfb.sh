@@ -0,0 +1,38 @@
+#!/bin/sh
+# Run a benchmark binary (with the given arguments) against a private Xvfb
+# server.
+#   BENCH_CRTCS    number of CRTCs (default 4)
+#   BENCH_DISPLAY  display number of the server (default 99)
+# Without Xvfb the benchmark runs against $DISPLAY (if any).
+
+bench=${1:?usage: $0 BENCH [ARG...]}
+shift
+crtcs=${BENCH_CRTCS:-4}
+dpy=:${BENCH_DISPLAY:-99}
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+  echo "Xvfb not found, using DISPLAY='$DISPLAY'" >&2
+  exec "$bench" "$@"
+fi
+
+if Xvfb -help 2>&1 | grep -q -- -crtcs; then
+  Xvfb "$dpy" -nolisten tcp -crtcs "$crtcs" -screen 0 1920x1080x24 &
+else # (older servers: one screen per CRTC)
+  screens=
+  i=0
+  while [ "$i" -lt "$crtcs" ]; do
+    screens="$screens -screen $i 1920x1080x24"
+    i=$((i + 1))
+  done
+  Xvfb "$dpy" -nolisten tcp $screens &
+fi
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null' EXIT INT TERM
+
+i=0 # wait for the server
+while [ ! -S "/tmp/.X11-unix/X${dpy#:}" ] && [ "$i" -lt 50 ]; do
+  sleep 0.1
+  i=$((i + 1))
+done
+
+DISPLAY=$dpy "$bench" "$@"
@@ -4,17 +4,61 @@
 ** Public domain
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/extensions/Xrandr.h>
+#include <xcb/present.h>
+#include <xcb/randr.h>
+#include <xcb/xcb.h>
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+
+#if defined(XSCT_DRM)
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* device used when '--drm' has no argument */
+#if !defined(DRM_DEVICE)
+#define DRM_DEVICE      "/dev/dri/card0"
+#endif
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 
 #define XSCT_VERSION              "2.4"
@@ -26,10 +70,20 @@
 
 #define MINTEMP       700
 #define TEMP_NORM     6500
+#define TEMP_NIGHT    4500
 
 #define MIN_DELTA     -1000000
 
 #define GAMMA_MULT    65535.0
+
+/* range of the gamma exponent ('-g') */
+#define GAMMA_EXPMIN  0.1
+#define GAMMA_EXPMAX  10.0
+
+/* fade curves ('--ease', see 'fadefill') */
+#define EASE_LINEAR   0  /* linear in kelvin, a frame per refresh */
+#define EASE_MIRED    1  /* linear in mired, in perceptual steps */
+#define EASE_SMOOTH   2  /* as EASE_MIRED, eased in and out */
 /*
 ** Approximation of the `redshift` table without limits.
 ** GAMMA = K0 + K1 * ln(T - T0)
@@ -54,6 +108,10 @@
 #define MAX(x, y)    (((x) > (y)) ? (x) : (y))
 #endif
 
+#if !defined(MIN)
+#define MIN(x, y)    (((x) < (y)) ? (x) : (y))
+#endif
+
 
 typedef struct tempstate {
   long temp;
@@ -73,8 +131,28 @@ static int fail = 0;                  /* error flag */
 static int crtc_arg = -1;             /* crtc index */
 static int screen_arg = -1;           /* screen index */
 static int verbose = 0;               /* do not by debug gamma by default */
+static int stats = 0;                 /* report timings and request counts */
+static int atomic = 0;                /* set the CRTCs within a server grab */
+static int json = 0;                  /* print estimates as JSON */
+static int coalesce = 0;              /* defer updates (see 'deferst') */
+static int force = 0;                 /* upload ramps even if unchanged */
+static long fade_ms = 0;              /* fade duration in milliseconds */
+static double gamma_arg = 0.0;        /* gamma exponent (0.0 if not given) */
+static int ease = EASE_SMOOTH;        /* fade curve */
 static long temp_day = TEMP_NORM;     /* default "day" temperature */
-static long temp_night = 4500;        /* default "night" temperature */
+static long temp_night = TEMP_NIGHT;  /* default "night" temperature */
+static FILE *fout = NULL;             /* regular output (stdout) */
+static FILE *ferr = NULL;             /* log output (stderr) */
+static const char *const *cmdenv = NULL;  /* environment of daemon client */
+static const char *schedule_arg = NULL;   /* schedule specification */
+static const char *batch_arg = NULL;      /* batch file ('NULL' is stdin) */
+static const char *output_arg = NULL;     /* output name */
+static const char *drm_arg = NULL;        /* DRM device ('NULL' is default) */
+static const char *cal_arg = NULL;        /* calibration to import */
+static const char *display_arg = NULL;    /* displays to run on */
+static const char *als_arg = NULL;        /* light sensor ('NULL' is any) */
+static const char *fan_display = NULL;    /* display of this process (see
+                                             'fanout') */
 
 
 /* {======================================================================
@@ -82,10 +160,10 @@ static long temp_night = 4500;        /* default "night" temperature */
 ** ======================================================================= */
 
 static void flog (const char *what, const char *fmt, va_list ap) {
-  fprintf(stderr, "%s (%s): ", progname, what);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  fflush(stderr);
+  fprintf(ferr, "%s (%s): ", progname, what);
+  vfprintf(ferr, fmt, ap);
+  fprintf(ferr, "\n");
+  fflush(ferr);
 }
 
 /* more ergonomic way to call 'flog' */
@@ -109,6 +187,64 @@ static void logerror (const char *fmt, ...) {
         loginfo("gamma: [R:%g, G:%g, B:%g], brightness: %g", \
                 (sg).red, (sg).green, (sg).blue, brightness)
 
+/* }{=====================================================================
+** Statistics
+** ======================================================================= */
+
+/*
+** With --stats each phase reports one line of 'key=value' pairs: the
+** phase, its screen and CRTC (if any), its duration and the number of
+** X requests it sent (from 'XNextRequest').
+*/
+
+/* monotonic time in seconds */
+static double monotime (void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec + (double)tp.tv_nsec * 1e-9;
+}
+
+
+typedef struct statmark {
+  double t;             /* start time */
+  unsigned long req;    /* 'XNextRequest' at start */
+} statmark;
+
+
+static statmark statstart;  /* start of the connection */
+
+
+static void logstat (const char *fmt, ...) {
+  dolog("stats", fmt);
+}
+
+
+static void statbegin (Display *dpy, statmark *m) {
+  if (stats) {
+    m->t = monotime();
+    m->req = (dpy) ? XNextRequest(dpy) : 0;
+  }
+}
+
+
+/*
+** Report phase 'what' started at 'm' (a negative 'screen' or 'crtc' is
+** not reported).
+*/
+static void statend (Display *dpy, const statmark *m, const char *what,
+                     int screen, int crtc) {
+  if (stats) {
+    char where[48] = "";
+    unsigned long req = (dpy) ? XNextRequest(dpy) - m->req : 0;
+    if (screen >= 0 && crtc >= 0)
+      snprintf(where, sizeof(where), " screen=%d crtc=%d", screen, crtc);
+    else if (screen >= 0)
+      snprintf(where, sizeof(where), " screen=%d", screen);
+    logstat("phase=%s%s ms=%.3f requests=%lu", what, where,
+            (monotime() - m->t) * 1e3, req);
+  }
+}
+
 /* }{=====================================================================
 ** CLI arguments
 ** ======================================================================= */
@@ -122,68 +258,213 @@ static void logerror (const char *fmt, ...) {
 #define has_D     (1<<5) /* -D or --day */
 #define has_c     (1<<6) /* -c or --crtc */
 #define has_s     (1<<7) /* -s or --screen */
+#define has_f     (1<<8) /* -f or --fade */
+#define has_daemon  (1<<9) /* --daemon */
+#define has_w     (1<<10) /* -w or --watch */
+#define has_S     (1<<11) /* --schedule */
+#define has_b     (1<<12) /* --batch */
+#define has_o     (1<<13) /* -o or --output */
+#define has_drm   (1<<14) /* --drm */
+#define has_cal   (1<<15) /* --import-cal */
+#define has_g     (1<<16) /* -g or --gamma */
+#define has_display (1<<17) /* --display */
+#define has_ease  (1<<18) /* --ease */
+#define has_als   (1<<19) /* --als */
+
+
+/* kinds of option arguments */
+#define ARG_NONE    0  /* no argument */
+#define ARG_NEED    1  /* required argument (see 'collectindex') */
+#define ARG_OPT     2  /* optional argument (see 'collectopt') */
+
+typedef struct option {
+  const char *name;     /* long name (without "--") */
+  char sname;           /* short name ('\0' if none) */
+  char arg;             /* kind of argument ('ARG_*') */
+  unsigned set;         /* flags set by the option */
+  unsigned clear;       /* flags cleared by the option */
+  int *on;              /* switch turned on by the option ('NULL' if none) */
+} option;
+
+
+/* the options, sorted by long name (see 'findoption') */
+static const option options[] = {
+  { "als",        '\0', ARG_OPT,  has_als,     0, NULL },
+  { "atomic",     '\0', ARG_NONE, 0,           0, &atomic },
+  { "batch",      '\0', ARG_OPT,  has_b,       0, NULL },
+  { "crtc",       'c',  ARG_NEED, has_c,       0, NULL },
+  { "daemon",     '\0', ARG_NONE, has_daemon,  0, NULL },
+  { "day",        'D',  ARG_NONE, has_D,       has_N | has_d | has_t, NULL },
+  { "delta",      'd',  ARG_NONE, has_d,       has_D | has_N, NULL },
+  { "display",    '\0', ARG_NEED, has_display, 0, NULL },
+  { "drm",        '\0', ARG_OPT,  has_drm,     0, NULL },
+  { "ease",       '\0', ARG_NEED, has_ease,    0, NULL },
+  { "fade",       'f',  ARG_NEED, has_f,       0, NULL },
+  { "force",      '\0', ARG_NONE, 0,           0, &force },
+  { "gamma",      'g',  ARG_NEED, has_g,       0, NULL },
+  { "help",       'h',  ARG_NONE, has_h,       0, NULL },
+  { "import-cal", '\0', ARG_NEED, has_cal,     0, NULL },
+  { "json",       '\0', ARG_NONE, 0,           0, &json },
+  { "night",      'N',  ARG_NONE, has_N,       has_D | has_d | has_t, NULL },
+  { "noenv",      'e',  ARG_NONE, has_e,       0, NULL },
+  { "output",     'o',  ARG_NEED, has_o,       0, NULL },
+  { "schedule",   '\0', ARG_NEED, has_S,       0, NULL },
+  { "screen",     's',  ARG_NEED, has_s,       0, NULL },
+  { "stats",      '\0', ARG_NONE, 0,           0, &stats },
+  { "toggle",     't',  ARG_NONE, has_t,       has_D | has_N, NULL },
+  { "verbose",    'v',  ARG_NONE, 0,           0, &verbose },
+  { "watch",      'w',  ARG_NONE, has_w,       0, NULL },
+};
+
+#define NOPTIONS    (sizeof(options) / sizeof(options[0]))
+
+
+static int cmpoption (const void *name, const void *o) {
+  return strcmp((const char *)name, ((const option *)o)->name);
+}
+
 
+/*
+** Find the option 'arg' ("-x" or "--name"), 'NULL' if it is none. Long
+** names are looked up by binary search; the short ones are few enough
+** for a scan of their single characters.
+*/
+static const option *findoption (const char *arg) {
+  if (arg[0] != '-' || arg[1] == '\0')
+    return NULL; /* (operand) */
+  else if (arg[1] == '-') /* long name? */
+    return bsearch(arg + 2, options, NOPTIONS, sizeof(option), cmpoption);
+  else if (arg[2] == '\0') { /* short name? */
+    for (size_t i = 0; i < NOPTIONS; i++)
+      if (options[i].sname == arg[1])
+        return &options[i];
+  }
+  return NULL; /* (e.g. a negative delta) */
+}
+
+
+/* parse all of 's' as an integer in [lo, hi] into '*v' */
+static int parselong (const char *s, long lo, long hi, long *v) {
+  char *end;
+  errno = 0;
+  *v = strtol(s, &end, 10);
+  return (end != s && *end == '\0' && errno == 0 && *v >= lo && *v <= hi);
+}
 
-/* strcmp for 'argv[i]' */
-#define IS(opt)     (strcmp(argv[i], opt) == 0)
 
-/* get the crtc or screen index argument */
+/* parse all of 's' as a finite number into '*v' */
+static int parsedouble (const char *s, double *v) {
+  char *end;
+  errno = 0;
+  *v = strtod(s, &end);
+  return (end != s && *end == '\0' && errno == 0 && isfinite(*v));
+}
+
+
+/* name of the argument of the option setting 'f' (for messages) */
+static const char *argname (unsigned f) {
+  return (f & has_c) ? "crtc index" :
+         (f & has_f) ? "duration" :
+         (f & has_S) ? "schedule" :
+         (f & has_o) ? "output name" :
+         (f & has_cal) ? "file" :
+         (f & has_g) ? "exponent" :
+         (f & has_ease) ? "curve" :
+         (f & has_display) ? "display list" : "screen index";
+}
+
+
+/* get the crtc/screen index, the output name, the fade duration and
+   curve, the gamma exponent, the displays or the schedule argument */
 static int collectindex (const char *const *argv, int argc, int i, unsigned f) {
-  i++; /* check next argument for the index */
-  if (i < argc) { /* have next argument? */
-    if (f & has_c) /* crtc index? */
-      crtc_arg = atoi(argv[i]);
-    else /* screen index */
-      screen_arg = atoi(argv[i]);
-    return 1; /* ok */
-  } else { /* missing index argument */
-    const char *arg = argv[--i];
-    const char *what = (f & has_c) ? "crtc" : "screen";
-    logerror("'%s' is missing %s index argument", arg, what);
+  const char *arg = argv[i + 1];
+  int ok = 1;
+  long l;
+  double x;
+  if (i + 1 >= argc) { /* missing index argument? */
+    logerror("'%s' is missing %s argument", argv[i], argname(f));
     return 0; /* fail */
   }
+  if (f & (has_c | has_s)) { /* crtc or screen index? */
+    if ((ok = parselong(arg, -1, INT_MAX, &l))) {
+      if (f & has_c)
+        crtc_arg = (int)l;
+      else
+        screen_arg = (int)l;
+    }
+  } else if (f & has_f) { /* fade duration? */
+    if ((ok = parselong(arg, 0, LONG_MAX, &l)))
+      fade_ms = l;
+  } else if (f & has_g) { /* gamma exponent? */
+    if ((ok = parsedouble(arg, &x) && x >= GAMMA_EXPMIN && x <= GAMMA_EXPMAX))
+      gamma_arg = x;
+  } else if (f & has_ease) { /* fade curve? */
+    static const char *const curves[] = { "linear", "mired", "smooth" };
+    ok = 0;
+    for (int k = 0; k < (int)(sizeof(curves) / sizeof(curves[0])); k++)
+      if (strcmp(arg, curves[k]) == 0) {
+        ease = k; /* (in the order of the 'EASE_*' values) */
+        ok = 1;
+      }
+  } else if (f & has_S) /* schedule? */
+    schedule_arg = arg;
+  else if (f & has_o) /* output name? */
+    output_arg = arg;
+  else if (f & has_cal) /* calibration file? */
+    cal_arg = arg;
+  else /* display list */
+    display_arg = arg;
+  if (!ok) /* (reported, but the argument is consumed) */
+    logerror("invalid %s '%s' for '%s'", argname(f), arg, argv[i]);
+  return 1; /* ok */
+}
+
+
+/* get the optional argument of '--batch' (a file), '--drm' (a path) or
+   '--als' (a path or "off") */
+static int collectopt (const char *const *argv, int argc, int i, unsigned f) {
+  const char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+  if (arg == NULL)
+    return 0; /* none */
+  else if ((f & has_b) && arg[0] != '-')
+    batch_arg = arg;
+  else if ((f & has_drm) && arg[0] == '/')
+    drm_arg = arg;
+  else if ((f & has_als) && (arg[0] == '/' || strcmp(arg, "off") == 0))
+    als_arg = arg;
+  else
+    return 0; /* (another option or the temperature) */
+  return 1;
 }
 
+
 /* collect the CLI arguments into 'flags' */
 static unsigned collectargs (int argc, const char *const *argv, tempstate *ts) {
-  unsigned f = 0; /* for 'collectindex' */
   unsigned flags = 0;
   progname = argv[0];
   for (int i = 1; i < argc; i++) {
-    if (IS("-h") || IS("--help")) {
-      flags |= has_h; /* show usage */
-      break; /* done */
-    } else if (IS("-v") || IS("--verbose"))
-      verbose = 1;
-    else if (IS("-d") || IS("--delta")) {
-      flags |= has_d;
-      flags &= ~(has_D | has_N); /* delta mode turns off -N and -D */
-    } else if (IS("-t") || IS("--toggle")) {
-      flags |= has_t;
-      flags &= ~(has_D | has_N); /* toggle turns off -N and -D */
-    } else if (IS("-s") || IS("--screen")) {
-      flags |= (f = has_s);
-      goto l_cindex;
-    } else if (IS("-c") || IS("--crtc")) {
-      flags |= (f = has_c);
-    l_cindex:
-      if (!collectindex(argv, argc, i, f)) { /* missing index argument? */
-        flags |= has_h; /* show usage before exit */
+    const option *o = findoption(argv[i]);
+    long l;
+    double x;
+    if (o) {
+      flags = (flags | o->set) & ~o->clear;
+      if (o->on) /* switch? */
+        *o->on = 1;
+      if (o->set & has_h) /* show usage? */
         break; /* done */
-      }
-      i++; /* skip index argument */
-    } else if (IS("-e") || IS("--noenv"))
-      flags |= has_e;
-    else if (IS("-N") || IS("--night")) {
-      flags |= has_N;
-      flags &= ~(has_D | has_d | has_t); /* -N turns off -D, -d and -t */
-    } else if (IS("-D") || IS("--day")) {
-      flags |= has_D;
-      flags &= ~(has_N | has_d | has_t); /* -D turns off -N, -d and -t */
-    } else if (!(flags & (has_N | has_D)) && ts->temp == MIN_DELTA)
-      ts->temp = atoi(argv[i]); /* assume argument is temperature */
-    else if (ts->brightness == MIN_DELTA)
-      ts->brightness = atof(argv[i]); /* assume argument is brightness */
+      else if (o->arg == ARG_NEED) {
+        if (!collectindex(argv, argc, i, o->set)) { /* missing argument? */
+          flags |= has_h; /* show usage before exit */
+          break; /* done */
+        }
+        i++; /* skip argument */
+      } else if (o->arg == ARG_OPT && collectopt(argv, argc, i, o->set))
+        i++; /* skip argument */
+    } else if (!(flags & (has_N | has_D)) && ts->temp == MIN_DELTA &&
+               parselong(argv[i], MIN_DELTA + 1, -(MIN_DELTA + 1), &l))
+      ts->temp = l; /* assume argument is temperature */
+    else if (ts->brightness == MIN_DELTA && parsedouble(argv[i], &x))
+      ts->brightness = x; /* assume argument is brightness */
     else { /* unknown argument */
       logerror("unrecognized argument '%s'", argv[i]);
       flags |= has_h;
@@ -195,7 +476,7 @@ static unsigned collectargs (int argc, const char *const *argv, tempstate *ts) {
 /* }===================================================================== */
 
 static void usage (void) {
-  printf("Xsct (%s)\n"
+  fprintf(fout, "Xsct (%s)\n"
          "Usage: %s [options] [temperature] [brightness]\n"
          "\tIf the argument is 0, xsct resets the display to the default "
          "temperature (%ldK)\n"
@@ -204,6 +485,8 @@ static void usage (void) {
          "Options:\n"
          "\t-h, --help \t xsct will display this usage information\n"
          "\t-v, --verbose \t xsct will display debugging information\n"
+         "\t    --stats \t xsct will report the duration and X requests of "
+         "each phase as key=value lines\n"
          "\t-d, --delta\t xsct will consider temperature and brightness "
          "parameters as relative shifts\n"
          "\t-s, --screen N\t xsct will only select screen specified by given "
@@ -211,11 +494,45 @@ static void usage (void) {
          "\t-t, --toggle \t xsct will toggle between 'day' and 'night' mode\n"
          "\t-c, --crtc N\t xsct will only select CRTC specified by given "
          "zero-based index\n"
+         "\t-o, --output NAME\t xsct will only select the CRTC driving the "
+         "output NAME (e.g. DP-1)\n"
          "\t-e, --noenv\t xsct will ignore environment variables\n"
+         "\t    --display LIST\t xsct will run on each display of the "
+         "comma-separated LIST (e.g. :0,:1,host:0) at the same time\n"
+         "\t    --import-cal FILE\t xsct will import the ArgyllCMS .cal FILE "
+         "as the calibration of the output given by -o\n"
+         "\t    --atomic\t xsct will generate all ramps first and set them "
+         "within one server grab, so the CRTCs change together\n"
+         "\t    --json\t xsct will print the estimates as a JSON array\n"
+         "\t    --force\t xsct will upload the ramps even if the CRTCs "
+         "already have them\n"
+         "\t-g, --gamma E\t xsct will shape the ramps as a gamma curve with "
+         "exponent E (0.1 to 10, as xgamma) instead of a straight line\n"
+         "\t-f, --fade MS\t xsct will gradually change to the new "
+         "temperature and brightness over MS milliseconds\n"
+         "\t    --ease CURVE\t xsct will fade along CURVE: linear (in "
+         "kelvin), mired or smooth (in mired, eased in and out; default)\n"
          "\t-N, --night\t xsct will set the display to the night temperature "
          "(%ldK)\n"
          "\t-D, --day\t xsct will set the display to the day temperature "
-         "(%ldK), this is equivalent to 'xsct 0'\n",
+         "(%ldK), this is equivalent to 'xsct 0'\n"
+         "\t    --schedule HH:MM-HH:MM|LAT,LON\t xsct will keep running and "
+         "switch to the day and night temperature at the given times or at "
+         "sunrise and sunset (\"off\" stops a daemon's schedule)\n"
+         "\t-w, --watch\t xsct will keep running and set the last "
+         "temperature and brightness again on CRTCs that are enabled\n"
+         "\t    --als [DEVICE|off]\t xsct will keep running and follow the "
+         "ambient light sensor DEVICE (an IIO sysfs directory) with the "
+         "brightness (\"off\" stops a daemon's)\n"
+         "\t    --batch [FILE]\t xsct will read lines of 'screen crtc "
+         "temperature [brightness]' from FILE (or stdin) and set them all at "
+         "once\n"
+#if defined(XSCT_DRM)
+         "\t    --drm [DEVICE]\t xsct will set the ramps of the KMS DEVICE "
+         "(default " DRM_DEVICE ") instead of using the X server\n"
+#endif
+         "\t    --daemon\t xsct will keep the display connection open and "
+         "serve other xsct invocations (implies --watch)\n",
          XSCT_VERSION, progname, temp_day, temp_night, temp_day);
 }
 
@@ -226,306 +543,4638 @@ static double trimdouble (double x, double a, double b) {
 }
 
 
-static int getscreengamma (Display *dpy, int iscreen, int icrtc, sgamma *sg) {
-  double gammar = 0.0, gammag = 0.0, gammab = 0.0;
-  Window root = RootWindow(dpy, iscreen);
-  XRRScreenResources *xrr_res = XRRGetScreenResourcesCurrent(dpy, root);
-  int ncrtc = xrr_res->ncrtc;
-  if ((unsigned)icrtc < (unsigned)ncrtc) /* crtc index in bounds? */
-    ncrtc = 1; /* only get temperature of icrtc */
-  else /* otherwise get all temperatures */
-    icrtc = 0; /* (start from first) */
-  for (int c = icrtc; c < (icrtc + ncrtc); c++) {
-    RRCrtc crtcxid = xrr_res->crtcs[c];
-    XRRCrtcGamma *xrr_gamma = XRRGetCrtcGamma(dpy, crtcxid);
-    int gi = xrr_gamma->size - 1;
-    gammar += xrr_gamma->red[gi];
-    gammag += xrr_gamma->green[gi];
-    gammab += xrr_gamma->blue[gi];
-    XRRFreeGamma(xrr_gamma);
-  }
-  XFree(xrr_res);
-  sg->red = gammar;
-  sg->green = gammag;
-  sg->blue = gammab;
-  return ncrtc;
-}
-
-
-/* get screen temp */
-static tempstate getst (Display *dpy, int iscreen, int icrtc) {
-  sgamma sg = { 0 };
-  double t;
-  tempstate ts;
-  int ncrtc = getscreengamma(dpy, iscreen, icrtc, &sg);
-  ts.brightness = MAX(sg.red, sg.green);
-  ts.brightness = MAX(sg.blue, ts.brightness);
-  if (ts.brightness > 0.0 && ncrtc > 0) { /* need median? */
-    double gdelta;
-    sg.red /= ts.brightness;
-    sg.green /= ts.brightness;
-    sg.blue /= ts.brightness;
-    ts.brightness /= ncrtc;
-    ts.brightness /= BRIGHTNESS_DIV;
-    ts.brightness = trimdouble(ts.brightness, 0.0, 1.0);
-    if (verbose)
-      logGamma(sg, ts.brightness);
-    gdelta = sg.blue - sg.red;
-    if (gdelta < 0.0) {
-      if (sg.blue > 0.0) {
-        t = exp((sg.green + 1.0 + gdelta - (GAMMA_K0GR + GAMMA_K0BR)) /
-                (GAMMA_K1GR + GAMMA_K1BR)) +
-            MINTEMP;
-      } else {
-        t = (sg.green > 0.0) ?
-              (exp((sg.green - GAMMA_K0GR) / GAMMA_K1GR) + MINTEMP) :
-              MINTEMP;
-      }
-    } else {
-      t = exp((sg.green + 1.0 - gdelta - (GAMMA_K0GB + GAMMA_K0RB)) /
-              (GAMMA_K1GB + GAMMA_K1RB)) +
-          (TEMP_NORM - MINTEMP);
-    }
-  } else {
-    t = 0.0;
-    ts.brightness = trimdouble(ts.brightness, 0.0, 1.0);
-  }
-  ts.temp = (long)(t + 0.5);
-  return ts;
-}
-
-
-/* set screen temp */
-static void setst (Display *dpy, int iscreen, int icrtc, tempstate ts) {
-  Window root = RootWindow(dpy, iscreen);
-  XRRScreenResources *xrr_res = XRRGetScreenResourcesCurrent(dpy, root);
-  double b = trimdouble(ts.brightness, 0.0, 1.0);
-  double t = (double)ts.temp;
-  int ncrtc = xrr_res->ncrtc;
+/* gamma multipliers for temperature 'temp' before trimming them to [0, 1] */
+static sgamma rawgamma (long temp) {
+  double t = (double)temp;
   sgamma sg = { 0 };
-  if (ts.temp < TEMP_NORM) {
+  if (temp < TEMP_NORM) {
     sg.red = 1.0;
-    if (ts.temp > MINTEMP) {
+    if (temp > MINTEMP) {
       const double g = log(t - MINTEMP);
-      sg.green = trimdouble(GAMMA_K0GR + GAMMA_K1GR * g, 0.0, 1.0);
-      sg.blue = trimdouble(GAMMA_K0BR + GAMMA_K1BR * g, 0.0, 1.0);
+      sg.green = GAMMA_K0GR + GAMMA_K1GR * g;
+      sg.blue = GAMMA_K0BR + GAMMA_K1BR * g;
     } else
       sg.green = sg.blue = 0.0;
   } else {
     const double g = log(t - (TEMP_NORM - MINTEMP));
-    sg.red = trimdouble(GAMMA_K0RB + GAMMA_K1RB * g, 0.0, 1.0);
-    sg.green = trimdouble(GAMMA_K0GB + GAMMA_K1GB * g, 0.0, 1.0);
+    sg.red = GAMMA_K0RB + GAMMA_K1RB * g;
+    sg.green = GAMMA_K0GB + GAMMA_K1GB * g;
     sg.blue = 1.0;
   }
-  if (verbose)
-    logGamma(sg, b);
-  if ((unsigned)icrtc < (unsigned)ncrtc)
-    ncrtc = 1;
-  else
-    icrtc = 0;
-  for (int c = icrtc; c < (icrtc + ncrtc); c++) {
-    RRCrtc crtcxid = xrr_res->crtcs[c];
-    int size = XRRGetCrtcGammaSize(dpy, crtcxid);
-    XRRCrtcGamma *xrr_crtc_gamma = XRRAllocGamma(size);
-    for (int i = 0; i < size; i++) {
-      const double g = GAMMA_MULT * b * (double)i / (double)size;
-      xrr_crtc_gamma->red[i] = (unsigned short int)(g * sg.red + 0.5);
-      xrr_crtc_gamma->green[i] = (unsigned short int)(g * sg.green + 0.5);
-      xrr_crtc_gamma->blue[i] = (unsigned short int)(g * sg.blue + 0.5);
-    }
-    XRRSetCrtcGamma(dpy, crtcxid, xrr_crtc_gamma);
-    XRRFreeGamma(xrr_crtc_gamma);
-  }
-  XFree(xrr_res);
+  return sg;
 }
 
 
-/* checks if temperature is in bounds and corrects it if needed */
-static long boundtemp (long temp, long dfl, const char *what) {
-  if (temp <= 0) {
-    logwarn("temperatures of 0 and below cannot be displayed (%s)", what);
-    return (dfl < 0) ? TEMP_NORM : dfl;
-  } else if (temp < MINTEMP) {
-    logwarn("temperatures below %d cannot be displayed (%s)", MINTEMP, what);
-    return (dfl < 0) ? MINTEMP : dfl;
-  }
-  return temp;
+/* trim multipliers to [0, 1] */
+static sgamma trimgamma (sgamma sg) {
+  sg.red = trimdouble(sg.red, 0.0, 1.0);
+  sg.green = trimdouble(sg.green, 0.0, 1.0);
+  sg.blue = trimdouble(sg.blue, 0.0, 1.0);
+  return sg;
 }
 
 
-/* checks if the brightness is in bounds and corrects it if needed */
-static double boundbrightness (double brightness) {
-  if (brightness < 0.0) {
-    logwarn("brightness values below 0.0 cannot be displayed");
-    brightness = 0.0;
-  } else if (brightness > 1.0) {
-    logwarn("brightness values above 1.0 cannot be displayed");
-    brightness = 1.0;
-  }
-  return brightness;
+/* get gamma multipliers for temperature 'temp' */
+static sgamma tempgamma (long temp) {
+  return trimgamma(rawgamma(temp));
 }
 
 
-/* checks the bounds of tempstate members and corrects them if needed */
-static void boundts (tempstate *const ts, const char *twhat) {
-  boundtemp(ts->temp, -1, twhat);
-  boundbrightness(ts->brightness);
-}
+/* {======================================================================
+** Temperature table
+** ======================================================================= */
 
+/*
+** Multipliers of the temperatures MINTEMP..TEMPLUT_MAX in steps of
+** TEMPLUT_STEP, for fade frames. Entries are computed by 'rawgamma' and
+** trimmed after interpolating, so results at table temperatures are
+** identical to 'tempgamma' and the bend where a channel reaches 0 is not
+** cut off between table temperatures.
+*/
 
-/* open connection to the X server */
-static Display *opendisplay (void) {
-  Display *dpy;
-  errno = 0;
-  if (!(dpy = XOpenDisplay(NULL))) { /* connection failed? */
-    const char *msg = "could not open a connection to the X server";
-    if (errno != 0)
-      logerror("%s: %s", msg, strerror(errno));
-    else
-      logerror("%s", msg);
-    loginfo("ensure DISPLAY environment variable is set correctly");
-    exit(EXIT_FAILURE);
-  }
-  return dpy;
-}
+#if !defined(TEMPLUT_STEP)
+#define TEMPLUT_STEP    10
+#endif
 
+#define TEMPLUT_MAX     25000
+#define TEMPLUT_N       ((TEMPLUT_MAX - MINTEMP) / TEMPLUT_STEP + 1)
 
-static void errorargscreen (int nscreen) {
-  if (nscreen > 1) /* multiple screens? */
-    logerror("invalid screen index '%d' (expected 0..%d)", screen_arg, nscreen);
-  else /* only one screen */
-    logerror("invalid screen index '%d' (expected 0)", screen_arg);
+#if (TEMP_NORM - MINTEMP) % TEMPLUT_STEP != 0
+#error "TEMPLUT_STEP must divide TEMP_NORM - MINTEMP"
+#endif
+
+
+static struct {
+  sgamma sg[TEMPLUT_N];   /* untrimmed multipliers of MINTEMP + i*STEP */
+  int built;              /* table was built */
+} templut;
+
+
+static void buildtemplut (void) {
+  if (templut.built)
+    return;
+  for (int i = 0; i < TEMPLUT_N; i++)
+    templut.sg[i] = rawgamma(MINTEMP + (long)i * TEMPLUT_STEP);
+  templut.built = 1;
 }
 
 
-static long envtotemp (const char *p, long dfl, const char *envn) {
-  char *endptr = NULL;
-  long x = strtol(p, &endptr, 10);
-  if (endptr == p) { /* nothing was converted? */
-    logwarn("invalid value for %s environment variable (expect integer)", envn);
-    x = dfl; /* set default value */
-  } /* else part of or the entire numeral was converted */
-  return boundtemp(x, dfl, envn);
+/* 'tempgamma' from the table (if built) */
+static sgamma lutgamma (long temp) {
+  long i, r;
+  const sgamma *a, *b;
+  sgamma sg;
+  double f;
+  if (!templut.built || temp < MINTEMP || temp > TEMPLUT_MAX)
+    return tempgamma(temp);
+  i = (temp - MINTEMP) / TEMPLUT_STEP;
+  r = (temp - MINTEMP) % TEMPLUT_STEP;
+  if (r == 0) /* table point? */
+    return trimgamma(templut.sg[i]);
+  a = &templut.sg[i];
+  b = &templut.sg[i + 1];
+  f = (double)r / TEMPLUT_STEP;
+  sg.red = a->red + (b->red - a->red) * f;
+  sg.green = a->green + (b->green - a->green) * f;
+  sg.blue = a->blue + (b->blue - a->blue) * f;
+  return trimgamma(sg);
 }
 
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Screen context
+** ======================================================================= */
+
+/* name of the root window property caching the ramp end points */
+#define XSCT_PROPERTY     "_XSCT_GAMMA"
+
+/* version of the property layout (first element of the property) */
+#define PROP_VERSION      2
+
+/* number of elements in a property entry (CRTC xid, size, end points,
+   ramp hash, temperature, brightness in two halves) */
+#define PROP_ENTRY        9
+
+
+/* maximum number of requests in flight before collecting their replies */
+#if !defined(PIPELINE_MAX)
+#define PIPELINE_MAX      32
+#endif
+
+
+/* state of a single CRTC */
+typedef struct crtcstate {
+  RRMode mode;              /* current mode ('None' if disabled) */
+  int active;               /* has a mode and drives some output */
+  int gammasize;            /* ramp size (0 if unknown, -1 if no ramp) */
+  int applied;              /* 'ts' was set on this CRTC */
+  tempstate ts;             /* last state set (see 'reapply') */
+  int pending;              /* 'ts' is not uploaded yet (see 'deferst') */
+  const struct calib *cal;  /* calibration of its output ('NULL' if none) */
+  double gamma;             /* gamma exponent of 'ts' (0.0 if unknown) */
+  int fading;               /* a fade is setting its ramp (so it is not
+                               recorded in 'XSCT_PROPERTY' until done) */
+  int known;                /* 'last' holds the current ramp end points */
+  unsigned short last[3];   /* last entry of the red, green and blue ramp */
+  uint32_t hash;            /* hash of the current ramp (with 'last') */
+  uint32_t sthash;          /* hash of the ramp 'st' was set with (0 if
+                               none, see 'setlastst') */
+  tempstate st;             /* exact state of that ramp */
+} crtcstate;
+
+
+/* the exact state 'st' of the current ramp of 'cs' is known */
+#define hasst(cs)   ((cs)->known && (cs)->sthash != 0 && \
+                     (cs)->sthash == (cs)->hash)
 
-/* logging for 'checkenv' */
-#define logenv(n, dfl) \
-  loginfo("unspecified %s environment variable (using default %ldK)", n, dfl);
 
 /*
-** Check the environment for the variables XSCT_TEMPERATURE_DAY and
-** XSCT_TEMPERATURE_NIGHT and use them as defaults (if any).
-** This also corrects then if they are out of some hard bounds.
+** Gamma exponent of the ramps of CRTC 'cs': the one given by '-g', or
+** else the one it was last set with (so deltas and toggles keep it).
 */
-static void checkenv (void) {
-  char *p;
-  if ((p = getenv(XSCT_TEMPERATURE_DAY)))
-    temp_day = envtotemp(p, temp_day, XSCT_TEMPERATURE_DAY);
-  else if (verbose)
-    logenv(XSCT_TEMPERATURE_DAY, temp_day);
-  if ((p = getenv(XSCT_TEMPERATURE_NIGHT)))
-    temp_night = envtotemp(p, temp_night, XSCT_TEMPERATURE_NIGHT);
-  else if (verbose)
-    logenv(XSCT_TEMPERATURE_NIGHT, temp_night);
-}
+#define crtcexp(cs)   ((gamma_arg > 0.0) ? gamma_arg : \
+                       ((cs)->gamma > 0.0) ? (cs)->gamma : 1.0)
 
 
-/* variation in screen temperature for 'toggledaynight' */
-#if !defined(TOGGLE_DELTA)
-#define TOGGLE_DELTA        200
-#endif
+/* screen state shared by every operation on the screen */
+typedef struct scrctx {
+  Window root;                  /* root window of the screen */
+  XRRScreenResources *xrr_res;  /* XRandR resources */
+  int ncrtc;                    /* number of CRTCs */
+  crtcstate *crtc;              /* state of each CRTC ('NULL' if unknown) */
+  int *live;                    /* indices of the active CRTCs */
+  int nlive;                    /* number of elements in 'live' */
+  int sel;                      /* CRTC selected by index (see 'selcrtcs') */
+  int hasinfo;                  /* 'live' and the modes are known */
+  int calread;                  /* calibrations were looked up */
+  xcb_randr_get_crtc_info_cookie_t *infock;  /* pending CRTC infos */
+  int propread;                 /* 'XSCT_PROPERTY' was read into 'crtc' */
+  int proppending;              /* 'propck' not collected yet */
+  xcb_get_property_cookie_t propck;  /* pending 'XSCT_PROPERTY' */
+  int propwrites;               /* own writes of 'XSCT_PROPERTY' whose
+                                   PropertyNotify is still to come */
+  int probe;                    /* CRTC read to check 'XSCT_PROPERTY' (-1
+                                   if none, see 'loadcache') */
+  uint32_t vserial;             /* serial of the last vblank request */
+  xcb_special_event_t *present;  /* Present events of 'root' ('NULL' if
+                                    not selected) */
+  xcb_present_event_t presenteid;  /* event context of 'present' */
+} scrctx;
+
+
+static struct {
+  scrctx *screens;  /* context of each screen */
+  int nscreen;      /* number of elements in 'screens' */
+} ctxs = { 0 };
+
+
+/* index of screen context 'sc' */
+#define ctxindex(sc)    ((int)((sc) - ctxs.screens))
+
+
+/* output of a screen and the CRTC driving it (see 'outputs') */
+typedef struct outinfo {
+  char name[64];  /* (longer names are left out) */
+  int crtc;       /* (-1 if disabled) */
+} outinfo;
+
 
 /*
-** Toggles the temperature between temp_night/temp_day for screens
-** in the interval [0, nscren).
+** Backend doing the gamma I/O of the screen contexts (XRandR or DRM).
+** The CRTCs of every request are given at once, so that a backend can
+** batch them; the ramps it sets may be queued until 'flush'.
 */
-static void toggledaynight (Display *dpy, int nscreen) {
-  for (int i = 0; i < nscreen; i++) {
-    tempstate ts = getst(dpy, i, crtc_arg);
-    if (ts.temp > (temp_day - TOGGLE_DELTA))
-      ts.temp = temp_night;
-    else
-      ts.temp = temp_day;
-    setst(dpy, i, crtc_arg, ts);
+typedef struct backend {
+  int (*nscreen) (Display *dpy);
+  /* enumerate the CRTCs of a screen (sets 'ncrtc') */
+  void (*crtcs) (Display *dpy, scrctx *sc, int iscreen);
+  /* get the modes and the 'live' list */
+  void (*info) (Display *dpy, scrctx *sc);
+  /* get the unknown ramp sizes of CRTCs 'ic' */
+  void (*sizes) (Display *dpy, scrctx *sc, const int *ic, int ncrtc);
+  /* get the unknown ramp end points of CRTCs 'ic' (see 'setlast') */
+  void (*ramps) (Display *dpy, scrctx *sc, const int *ic, int ncrtc);
+  void (*set) (Display *dpy, scrctx *sc, int c, XRRCrtcGamma *xrr_gamma);
+  void (*flush) (Display *dpy);
+  /* get the outputs of a screen into '*out' (freed by the caller, 'NULL'
+     if none), returns their number */
+  int (*outputs) (Display *dpy, scrctx *sc, outinfo **out);
+  /* refresh rate of a CRTC in Hz (0.0 if unknown) */
+  double (*refresh) (scrctx *sc, int c);
+  /* ask for a notice of the next vblank (0 if unsupported) */
+  int (*vblank) (Display *dpy, scrctx *sc);
+  /* check without blocking whether that vblank came */
+  int (*vblanked) (Display *dpy, scrctx *sc);
+  /* descriptor to poll for the notice */
+  int (*fd) (Display *dpy);
+  /* load and store known end points (see 'Ramp end point cache') */
+  void (*readcache) (Display *dpy, scrctx *sc);
+  void (*writecache) (Display *dpy, scrctx *sc);
+  /* hold off other clients while setting ramps (see 'grab') */
+  void (*lock) (Display *dpy);
+  void (*unlock) (Display *dpy);
+  /* free what 'crtcs' and 'info' allocated */
+  void (*release) (Display *dpy, scrctx *sc);
+} backend;
+
+
+static const backend xrrbackend;  /* (defined in 'XRandR backend') */
+
+static const backend *be = &xrrbackend;  /* backend in use */
+
+
+static Atom xa_gamma = None;  /* 'XSCT_PROPERTY' atom */
+static xcb_intern_atom_cookie_t xa_gammack;  /* pending 'xa_gamma' */
+static int xa_gammapending = 0;
+
+
+/* request 'xa_gamma' without waiting for the reply (see 'gammaatom') */
+static void internatom (Display *dpy) {
+  if (xa_gamma == None && !xa_gammapending) {
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xa_gammack = xcb_intern_atom(conn, 0, sizeof(XSCT_PROPERTY) - 1,
+                                 XSCT_PROPERTY);
+    xa_gammapending = 1;
   }
 }
 
 
-static void printestimate (Display *dpy, int firstscreen, int lastscreen) {
-  while (firstscreen <= lastscreen) {
-    tempstate ts = getst(dpy, firstscreen, crtc_arg);
-    printf("Screen[%d]: temp ~ %ld %g\n", firstscreen, ts.temp, ts.brightness);
-    firstscreen++;
+static Atom gammaatom (Display *dpy) {
+  internatom(dpy);
+  if (xa_gammapending) {
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(conn, xa_gammack, NULL);
+    if (r) {
+      xa_gamma = r->atom;
+      free(r);
+    }
+    xa_gammapending = 0;
   }
+  return xa_gamma;
 }
 
 
-static void regularsct (Display *dpy, tempstate ts, int first, int last) {
-  if (ts.temp == 0) /* set default value? */
-    ts.temp = temp_day;
-  else
-    boundts(&ts, "specified by user");
-  for (int i = first; i <= last; i++) /* for each screen... */
-    setst(dpy, i, crtc_arg, ts); /* set temp */
+/* get the context of screen 'iscreen', enumerating its CRTCs if needed */
+static scrctx *getctx (Display *dpy, int iscreen) {
+  scrctx *sc;
+  if (ctxs.screens == NULL) { /* first use? */
+    int n = be->nscreen(dpy);
+    if (!(ctxs.screens = calloc((size_t)n, sizeof(scrctx)))) {
+      logerror("cannot allocate screen contexts");
+      exit(EXIT_FAILURE);
+    }
+    ctxs.nscreen = n;
+  }
+  sc = &ctxs.screens[iscreen];
+  if (sc->crtc == NULL) { /* CRTCs not enumerated? */
+    size_t n;
+    be->crtcs(dpy, sc, iscreen);
+    sc->propread = 0;
+    sc->hasinfo = 0;
+    sc->calread = 0;
+    sc->probe = -1;
+    sc->nlive = 0;
+    n = (size_t)MAX(sc->ncrtc, 1);
+    sc->crtc = calloc(n, sizeof(crtcstate));
+    sc->live = malloc(n * sizeof(int));
+    if (sc->crtc == NULL || sc->live == NULL) {
+      logerror("cannot allocate screen context");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return sc;
 }
 
 
-static void deltasct (Display *dpy, tempstate ts, int first, int last) {
-  if (ts.temp == MIN_DELTA || ts.brightness == MIN_DELTA)
-    logerror("temperature and brightness delta must both be specified");
-  else { /* shift temperature and optionally brightness */
-    for (int i = first; i <= last; i++) { /* for each screen... */
-      tempstate dts = getst(dpy, i, crtc_arg);
-      dts.temp += ts.temp;
-      dts.brightness += ts.brightness;
-      boundts(&dts, "specified by user");
-      setst(dpy, i, crtc_arg, dts);
-    }
+/* get the modes of the CRTCs of 'sc' and which of them are active */
+static void fetchinfo (Display *dpy, scrctx *sc) {
+  if (!sc->hasinfo) {
+    be->info(dpy, sc);
+    sc->hasinfo = 1;
   }
 }
 
 
-static void processargs (Display *dpy, unsigned flags, int firstscreen,
-                         int lastscreen, tempstate ts) {
-  if (!(flags & has_e)) /* check environment variables? */
-    checkenv(); /* (this might change default values) */
-  if (flags & has_t) /* -t or --toggle? */
-    toggledaynight(dpy, lastscreen + 1);
-  if ((ts.brightness == MIN_DELTA) && !(flags & has_d))
-    ts.brightness = 1.0; /* set default brightness */
-  if (flags & has_D) /* -D or --day */
-    ts.temp = temp_day;
+/*
+** Get the CRTCs selected by 'icrtc' into 'ic', returns their number.
+** A valid index selects only that CRTC, otherwise every active CRTC
+** (with a mode and some output) is selected.
+*/
+static int selcrtcs (Display *dpy, scrctx *sc, int icrtc, const int **ic) {
+  if ((unsigned)icrtc < (unsigned)sc->ncrtc) { /* in bounds? */
+    sc->sel = icrtc;
+    *ic = &sc->sel;
+    return 1; /* only 'icrtc' */
+  }
+  fetchinfo(dpy, sc);
+  *ic = sc->live;
+  return sc->nlive;
+}
+
+
+/*
+** Remember 'ts' as the state of the CRTCs selected by 'icrtc'. Without
+** an index this includes the inactive CRTCs, so they get 'ts' when they
+** are enabled later (see 'reapply').
+*/
+static void keepst (scrctx *sc, int icrtc, tempstate ts) {
+  int c = 0, n = sc->ncrtc;
+  if ((unsigned)icrtc < (unsigned)n) { /* in bounds? */
+    c = icrtc;
+    n = icrtc + 1;
+  }
+  for (; c < n; c++) {
+    sc->crtc[c].applied = 1;
+    sc->crtc[c].ts = ts;
+    sc->crtc[c].gamma = crtcexp(&sc->crtc[c]);
+    sc->crtc[c].pending = 0; /* (superseded) */
+  }
+}
+
+
+/* release the CRTCs of screen 'iscreen' (enumerated again on next use) */
+static void dropctx (Display *dpy, int iscreen) {
+  scrctx *sc;
+  if (iscreen < ctxs.nscreen && (sc = &ctxs.screens[iscreen])->crtc) {
+    be->release(dpy, sc);
+    free(sc->live);
+    free(sc->crtc);
+    sc->live = NULL;
+    sc->crtc = NULL;
+    sc->nlive = 0;
+  }
+}
+
+
+static void freectxs (Display *dpy) {
+  for (int i = 0; i < ctxs.nscreen; i++)
+    dropctx(dpy, i);
+  free(ctxs.screens);
+  ctxs.screens = NULL;
+  ctxs.nscreen = 0;
+}
+
+/* }{=====================================================================
+** Ramp end point cache
+** ======================================================================= */
+
+/*
+** Each time xsct sets a ramp it records the ramp size, end points, hash
+** and the exact state set (temperature 0 if not known) of the CRTCs in
+** 'XSCT_PROPERTY' on the root window:
+** { PROP_VERSION, configTimestamp,
+**   { crtcxid, size, red, green, blue, hash, temp, bhi, blo } * n }
+** where 'bhi' and 'blo' are the halves of the bits of the brightness, so
+** estimates read one property instead of transferring whole ramps and
+** need no inverse of the curves. CRTCs in the middle of a fade have no
+** entry, so a process killed while fading leaves none of its frames
+** behind. Other programs set ramps without updating the property, so
+** the ramp of one CRTC is read along with it and the recorded end points
+** are used only if that ramp is still the recorded one (see
+** 'loadcache'); otherwise, as when the screen configuration changed (the
+** 'configTimestamp' of the screen resources no longer matches), the
+** ramps are read and only the states of those whose hash is still the
+** recorded one are kept.
+*/
+
+/*
+** Request 'XSCT_PROPERTY' of 'sc' without waiting for the reply (see
+** 'readprop'). Sent along with the CRTC infos, so an estimate waits for
+** both replies and the probe at once (see 'loadcache').
+*/
+static void requestprop (Display *dpy, scrctx *sc) {
+  Atom atom = gammaatom(dpy);
+  if (atom != None && !sc->proppending) {
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    sc->propck = xcb_get_property(conn, 0, (xcb_window_t)sc->root,
+                                  (xcb_atom_t)atom, XCB_ATOM_INTEGER, 0,
+                                  2 + PROP_ENTRY * (uint32_t)sc->ncrtc);
+    sc->proppending = 1;
+  }
+}
+
+
+/*
+** Read 'XSCT_PROPERTY' into the CRTCs of 'sc': the end points of those
+** not known yet, unless the entry of the probe does not match its ramp,
+** and the states of those without one.
+*/
+static void readprop (Display *dpy, scrctx *sc) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  xcb_get_property_reply_t *r;
+  statmark m;
+  sc->propread = 1;
+  statbegin(dpy, &m);
+  requestprop(dpy, sc); /* (unless already requested) */
+  if (!sc->proppending) {
+    statend(dpy, &m, "property", ctxindex(sc), -1);
+    return; /* no atom */
+  }
+  sc->proppending = 0;
+  r = xcb_get_property_reply(conn, sc->propck, NULL);
+  if (r && r->type == XCB_ATOM_INTEGER && r->format == 32 &&
+      r->value_len >= 2) {
+    const uint32_t *p = (const uint32_t *)xcb_get_property_value(r);
+    const uint32_t n = r->value_len;
+    int fresh = (p[1] == (sc->xrr_res->configTimestamp & 0xffffffffUL));
+    for (uint32_t k = 2; fresh && sc->probe >= 0 && p[0] == PROP_VERSION &&
+         k + PROP_ENTRY <= n; k += PROP_ENTRY) { /* (see 'loadcache') */
+      const crtcstate *cs = &sc->crtc[sc->probe];
+      if (sc->xrr_res->crtcs[sc->probe] == (RRCrtc)p[k])
+        fresh = (cs->known && cs->gammasize == (int32_t)p[k + 1] &&
+                 cs->last[0] == p[k + 2] && cs->last[1] == p[k + 3] &&
+                 cs->last[2] == p[k + 4] && cs->hash == p[k + 5]);
+    }
+    sc->probe = -1;
+    for (uint32_t k = 2; p[0] == PROP_VERSION && k + PROP_ENTRY <= n;
+         k += PROP_ENTRY) {
+      for (int c = 0; c < sc->xrr_res->ncrtc; c++) {
+        crtcstate *cs = &sc->crtc[c];
+        if (sc->xrr_res->crtcs[c] == (RRCrtc)p[k]) {
+          if (p[k + 6] != 0 && cs->sthash == 0) { /* (see 'hasst') */
+            uint64_t u = ((uint64_t)p[k + 7] << 32) | p[k + 8];
+            cs->st.temp = (long)p[k + 6];
+            memcpy(&cs->st.brightness, &u, sizeof(double));
+            cs->sthash = p[k + 5];
+          }
+          if (fresh && !cs->known) { /* (otherwise only the state is) */
+            cs->gammasize = MAX((int32_t)p[k + 1], 0); /* (0 is unknown) */
+            cs->last[0] = (unsigned short)p[k + 2];
+            cs->last[1] = (unsigned short)p[k + 3];
+            cs->last[2] = (unsigned short)p[k + 4];
+            cs->hash = p[k + 5];
+            cs->known = 1;
+          }
+          break;
+        }
+      }
+    }
+  }
+  free(r);
+  statend(dpy, &m, "property", ctxindex(sc), -1);
+}
+
+
+/* write the known end points of 'sc' into 'XSCT_PROPERTY' */
+static void writeprop (Display *dpy, scrctx *sc) {
+  statmark m;
+  long *data;
+  int n = 0;
+  if (!sc->propread) { /* might lose entries of CRTCs not set by us? */
+    int c = 0;
+    while (c < sc->xrr_res->ncrtc && sc->crtc[c].known)
+      c++;
+    if (c < sc->xrr_res->ncrtc || sc->proppending) /* (no stale reply) */
+      readprop(dpy, sc);
+  }
+  statbegin(dpy, &m);
+  data = malloc(sizeof(long) * (2 + PROP_ENTRY * (size_t)sc->xrr_res->ncrtc));
+  if (data == NULL)
+    return; /* (it is only a cache) */
+  data[n++] = PROP_VERSION;
+  data[n++] = (long)sc->xrr_res->configTimestamp;
+  for (int c = 0; c < sc->xrr_res->ncrtc; c++) {
+    const crtcstate *cs = &sc->crtc[c];
+    if (cs->known && !cs->fading) {
+      uint64_t u = 0;
+      if (hasst(cs))
+        memcpy(&u, &cs->st.brightness, sizeof(double));
+      data[n++] = (long)sc->xrr_res->crtcs[c];
+      data[n++] = cs->gammasize;
+      data[n++] = cs->last[0];
+      data[n++] = cs->last[1];
+      data[n++] = cs->last[2];
+      data[n++] = (long)cs->hash;
+      data[n++] = hasst(cs) ? cs->st.temp : 0;
+      data[n++] = (long)(u >> 32);
+      data[n++] = (long)(u & 0xffffffffUL);
+    }
+  }
+  XChangeProperty(dpy, sc->root, gammaatom(dpy), XA_INTEGER, 32,
+                  PropModeReplace, (unsigned char *)data, n);
+  sc->propwrites++; /* (see 'propchanged') */
+  free(data);
+  statend(dpy, &m, "writeprop", ctxindex(sc), -1);
+}
+
+
+/* FNV-1a hash of a ramp (never 0, which is "none") */
+static uint32_t ramphash (int size, const unsigned short *red,
+                          const unsigned short *green,
+                          const unsigned short *blue) {
+  const unsigned short *ch[3] = { red, green, blue };
+  uint32_t h = 2166136261u;
+  for (int k = 0; k < 3; k++)
+    for (int i = 0; i < size; i++) {
+      h = (h ^ (ch[k][i] & 0xff)) * 16777619u;
+      h = (h ^ (ch[k][i] >> 8)) * 16777619u;
+    }
+  return h ? h : 1;
+}
+
+
+/*
+** Record a ramp of hash 'hash' as the current one of CRTC 'c'. Its exact
+** state stays known only if it is the ramp that state was recorded with.
+*/
+static void setlasthash (scrctx *sc, int c, int size,
+                         const unsigned short *red,
+                         const unsigned short *green,
+                         const unsigned short *blue, uint32_t hash) {
+  crtcstate *cs = &sc->crtc[c];
+  cs->gammasize = size;
+  cs->last[0] = red[size - 1];
+  cs->last[1] = green[size - 1];
+  cs->last[2] = blue[size - 1];
+  cs->hash = hash;
+  cs->known = 1;
+}
+
+
+/* record a ramp read from CRTC 'c' as its current one */
+static void setlast (scrctx *sc, int c, int size, const unsigned short *red,
+                     const unsigned short *green, const unsigned short *blue) {
+  setlasthash(sc, c, size, red, green, blue,
+              ramphash(size, red, green, blue));
+}
+
+/* record the ramp 'g' of hash 'h' as the current one of CRTC 'c' */
+#define setlastramp(sc, c, g, h) \
+        setlasthash(sc, c, (g)->size, (g)->red, (g)->green, (g)->blue, h)
+
+
+/*
+** Record 'ts' as the exact state of the current ramp of CRTC 'c'. A ramp
+** of brightness 0 is black whatever the temperature, so its state is not
+** kept (estimates give 0K for it, see "Quirks" in the README).
+*/
+static void setlastst (scrctx *sc, int c, tempstate ts) {
+  crtcstate *cs = &sc->crtc[c];
+  cs->sthash = (cs->known && ts.brightness > 0.0) ? cs->hash : 0;
+  cs->st = ts;
+}
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** XRandR backend
+** ======================================================================= */
+
+static int xrrnscreen (Display *dpy) {
+  return XScreenCount(dpy);
+}
+
+
+/* fetch the resources of screen 'iscreen', requesting the CRTC infos */
+static void xrrcrtcs (Display *dpy, scrctx *sc, int iscreen) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  statmark m;
+  statbegin(dpy, &m);
+  internatom(dpy); /* (reply arrives along with the resources) */
+  sc->root = RootWindow(dpy, iscreen);
+  sc->xrr_res = XRRGetScreenResourcesCurrent(dpy, sc->root);
+  sc->ncrtc = sc->xrr_res->ncrtc;
+  sc->infock = malloc(sizeof(xcb_randr_get_crtc_info_cookie_t) *
+                      (size_t)MAX(sc->ncrtc, 1));
+  if (sc->infock == NULL) {
+    logerror("cannot allocate screen context");
+    exit(EXIT_FAILURE);
+  }
+  for (int c = 0; c < sc->ncrtc; c++) /* (collected by 'xrrinfo') */
+    sc->infock[c] = xcb_randr_get_crtc_info(conn, sc->xrr_res->crtcs[c],
+                        (xcb_timestamp_t)sc->xrr_res->configTimestamp);
+  requestprop(dpy, sc); /* (collected by 'readprop') */
+  statend(dpy, &m, "resources", iscreen, -1);
+}
+
+
+/*
+** Collect the CRTC infos requested by 'xrrcrtcs' (see 'fetchinfo'). The
+** replies usually arrived already along with the reply of an earlier
+** request.
+*/
+static void xrrinfo (Display *dpy, scrctx *sc) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  statmark m;
+  statbegin(dpy, &m);
+  for (int c = 0; c < sc->ncrtc; c++) {
+    xcb_randr_get_crtc_info_reply_t *r;
+    crtcstate *cs = &sc->crtc[c];
+    r = xcb_randr_get_crtc_info_reply(conn, sc->infock[c], NULL);
+    cs->mode = r ? r->mode : None;
+    cs->active = (r && r->mode != None && r->num_outputs > 0);
+    if (cs->active)
+      sc->live[sc->nlive++] = c;
+    free(r);
+  }
+  free(sc->infock);
+  sc->infock = NULL;
+  statend(dpy, &m, "info", ctxindex(sc), -1);
+}
+
+
+/* fetch the unknown ramp sizes of the CRTCs in 'ic' at once */
+static void xrrsizes (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  xcb_randr_get_crtc_gamma_size_cookie_t ck[PIPELINE_MAX];
+  int pc[PIPELINE_MAX];
+  int i = 0, nreq = 0;
+  statmark m;
+  statbegin(dpy, &m);
+  while (i < ncrtc) {
+    int n = 0;
+    for (; i < ncrtc && n < PIPELINE_MAX; i++) { /* send requests */
+      if (sc->crtc[ic[i]].gammasize == 0) {
+        pc[n] = ic[i];
+        ck[n++] = xcb_randr_get_crtc_gamma_size(conn,
+                                                sc->xrr_res->crtcs[ic[i]]);
+      }
+    }
+    for (int k = 0; k < n; k++) { /* collect replies */
+      xcb_randr_get_crtc_gamma_size_reply_t *r;
+      r = xcb_randr_get_crtc_gamma_size_reply(conn, ck[k], NULL);
+      sc->crtc[pc[k]].gammasize = (r && r->size > 0) ? r->size : -1;
+      free(r);
+    }
+    nreq += n;
+  }
+  if (nreq > 0)
+    statend(dpy, &m, "sizes", ctxindex(sc), -1);
+}
+
+
+/* fetch the ramps of the CRTCs in 'ic' whose end points are unknown */
+static void xrrramps (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  xcb_randr_get_crtc_gamma_cookie_t ck[PIPELINE_MAX];
+  int pc[PIPELINE_MAX];
+  int i = 0, nreq = 0;
+  statmark m;
+  statbegin(dpy, &m);
+  while (i < ncrtc) {
+    int n = 0;
+    for (; i < ncrtc && n < PIPELINE_MAX; i++) { /* send requests */
+      const crtcstate *cs = &sc->crtc[ic[i]];
+      if (!cs->known && cs->gammasize >= 0) {
+        pc[n] = ic[i];
+        ck[n++] = xcb_randr_get_crtc_gamma(conn, sc->xrr_res->crtcs[ic[i]]);
+      }
+    }
+    for (int k = 0; k < n; k++) { /* collect replies */
+      xcb_randr_get_crtc_gamma_reply_t *r;
+      r = xcb_randr_get_crtc_gamma_reply(conn, ck[k], NULL);
+      if (r && r->size > 0)
+        setlast(sc, pc[k], r->size, xcb_randr_get_crtc_gamma_red(r),
+                xcb_randr_get_crtc_gamma_green(r),
+                xcb_randr_get_crtc_gamma_blue(r));
+      else /* CRTC has no ramp */
+        sc->crtc[pc[k]].gammasize = -1;
+      free(r);
+    }
+    nreq += n;
+  }
+  if (nreq > 0)
+    statend(dpy, &m, "ramps", ctxindex(sc), -1);
+}
+
+
+static void xrrset (Display *dpy, scrctx *sc, int c,
+                    XRRCrtcGamma *xrr_gamma) {
+  XRRSetCrtcGamma(dpy, sc->xrr_res->crtcs[c], xrr_gamma);
+}
+
+
+static void xrrflush (Display *dpy) {
+  XFlush(dpy);
+}
+
+
+/* get the outputs of 'sc' with the index of the CRTC driving each */
+static int xrroutputs (Display *dpy, scrctx *sc, outinfo **out) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  xcb_randr_get_output_info_cookie_t ck[PIPELINE_MAX];
+  int o = 0, nout = 0;
+  *out = NULL;
+  if (sc->xrr_res->noutput == 0)
+    return 0;
+  if (!(*out = malloc((size_t)sc->xrr_res->noutput * sizeof(outinfo)))) {
+    logwarn("cannot allocate outputs");
+    return 0;
+  }
+  while (o < sc->xrr_res->noutput) {
+    int n = 0;
+    for (; o < sc->xrr_res->noutput && n < PIPELINE_MAX; o++) /* send */
+      ck[n++] = xcb_randr_get_output_info(conn, sc->xrr_res->outputs[o],
+                    (xcb_timestamp_t)sc->xrr_res->configTimestamp);
+    for (int k = 0; k < n; k++) { /* collect replies */
+      xcb_randr_get_output_info_reply_t *r;
+      int len;
+      r = xcb_randr_get_output_info_reply(conn, ck[k], NULL);
+      if (r && (len = xcb_randr_get_output_info_name_length(r)) <
+          (int)sizeof((*out)->name)) {
+        outinfo *oi = &(*out)[nout++];
+        memcpy(oi->name, xcb_randr_get_output_info_name(r), (size_t)len);
+        oi->name[len] = '\0';
+        oi->crtc = -1; /* (not driven by any CRTC) */
+        for (int c = 0; c < sc->xrr_res->ncrtc; c++)
+          if (r->crtc != None && sc->xrr_res->crtcs[c] == r->crtc)
+            oi->crtc = c;
+      }
+      free(r);
+    }
+  }
+  return nout;
+}
+
+
+/* refresh rate of 'mode' in Hz (0.0 if unknown) */
+static double modehz (const XRRScreenResources *xrr_res, RRMode mode) {
+  for (int m = 0; m < xrr_res->nmode; m++) {
+    const XRRModeInfo *mi = &xrr_res->modes[m];
+    if (mi->id == mode && mi->hTotal && mi->vTotal) {
+      double vtotal = (double)mi->vTotal;
+      if (mi->modeFlags & RR_DoubleScan) vtotal *= 2.0;
+      if (mi->modeFlags & RR_Interlace) vtotal /= 2.0;
+      return (double)mi->dotClock / ((double)mi->hTotal * vtotal);
+    }
+  }
+  return 0.0;
+}
+
+
+static double xrrrefresh (scrctx *sc, int c) {
+  return modehz(sc->xrr_res, sc->crtc[c].mode);
+}
+
+
+/*
+** Ask for a PresentCompleteNotify at the next vblank (MSC) of the root
+** window of 'sc'. The server times it by the CRTC showing most of the
+** root window, so with several CRTCs the largest one paces the rest.
+*/
+static int xrrvblank (Display *dpy, scrctx *sc) {
+  static uint32_t serial = 0;
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  if (sc->present == NULL) { /* first request on this screen? */
+    const xcb_query_extension_reply_t *ext;
+    ext = xcb_get_extension_data(conn, &xcb_present_id); /* (cached) */
+    if (ext == NULL || !ext->present)
+      return 0; /* no Present */
+    sc->presenteid = xcb_generate_id(conn);
+    xcb_present_select_input(conn, sc->presenteid, (xcb_window_t)sc->root,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+    sc->present = xcb_register_for_special_xge(conn, &xcb_present_id,
+                                               sc->presenteid, NULL);
+    if (sc->present == NULL)
+      return 0;
+  }
+  sc->vserial = ++serial;
+  xcb_present_notify_msc(conn, (xcb_window_t)sc->root, sc->vserial, 0, 1, 0);
+  return 1;
+}
+
+
+static int xrrvblanked (Display *dpy, scrctx *sc) {
+  xcb_connection_t *conn = XGetXCBConnection(dpy);
+  xcb_generic_event_t *ev;
+  int hit = 0;
+  if (sc->present == NULL)
+    return 0;
+  while ((ev = xcb_poll_for_special_event(conn, sc->present)) != NULL) {
+    const xcb_present_complete_notify_event_t *cn =
+      (const xcb_present_complete_notify_event_t *)ev;
+    if (cn->event_type == XCB_PRESENT_COMPLETE_NOTIFY &&
+        cn->kind == XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC &&
+        cn->serial == sc->vserial) /* (not an older request) */
+      hit = 1;
+    free(ev);
+  }
+  return hit;
+}
+
+
+static int xrrfd (Display *dpy) {
+  return ConnectionNumber(dpy);
+}
+
+
+static void xrrlock (Display *dpy) {
+  XGrabServer(dpy);
+}
+
+
+static void xrrunlock (Display *dpy) {
+  XUngrabServer(dpy);
+}
+
+
+/* discard the CRTC infos of 'sc' that were not collected */
+static void xrrdropinfo (Display *dpy, scrctx *sc) {
+  if (sc->infock) { /* CRTC infos still pending? */
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    for (int c = 0; c < sc->ncrtc; c++)
+      xcb_discard_reply(conn, sc->infock[c].sequence);
+    free(sc->infock);
+    sc->infock = NULL;
+  }
+  if (sc->proppending) { /* property still pending? */
+    xcb_discard_reply(XGetXCBConnection(dpy), sc->propck.sequence);
+    sc->proppending = 0;
+  }
+}
+
+
+static void xrrrelease (Display *dpy, scrctx *sc) {
+  xrrdropinfo(dpy, sc);
+  if (sc->present) { /* (see 'xrrvblank') */
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_present_select_input(conn, sc->presenteid, (xcb_window_t)sc->root,
+                             XCB_PRESENT_EVENT_MASK_NO_EVENT);
+    xcb_unregister_for_special_event(conn, sc->present);
+    sc->present = NULL;
+  }
+  XRRFreeScreenResources(sc->xrr_res);
+  sc->xrr_res = NULL;
+}
+
+
+/*
+** Fetch the resources of screen 'iscreen' again (after a configuration
+** change), keeping the state of the CRTCs that still exist.
+*/
+static void refreshctx (Display *dpy, int iscreen) {
+  scrctx *sc = &ctxs.screens[iscreen];
+  XRRScreenResources *ores = sc->xrr_res;
+  crtcstate *ocrtc = sc->crtc;
+  xrrdropinfo(dpy, sc);
+  free(sc->live);
+  sc->live = NULL;
+  sc->crtc = NULL;
+  sc = getctx(dpy, iscreen);
+  for (int c = 0; c < sc->xrr_res->ncrtc; c++) {
+    for (int k = 0; k < ores->ncrtc; k++) {
+      if (ores->crtcs[k] == sc->xrr_res->crtcs[c]) { /* same CRTC? */
+        sc->crtc[c] = ocrtc[k]; /* (mode is refreshed by 'fetchinfo') */
+        break;
+      }
+    }
+  }
+  XRRFreeScreenResources(ores);
+  free(ocrtc);
+}
+
+
+static const backend xrrbackend = {
+  xrrnscreen, xrrcrtcs, xrrinfo, xrrsizes, xrrramps, xrrset, xrrflush,
+  xrroutputs, xrrrefresh, xrrvblank, xrrvblanked, xrrfd, readprop, writeprop,
+  xrrlock, xrrunlock, xrrrelease
+};
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** DRM backend
+** ======================================================================= */
+
+#if defined(XSCT_DRM)
+
+/*
+** With '--drm' the ramps of a KMS device are set directly with the
+** legacy gamma ioctls, without any X server. The device is a single
+** screen. Reading a ramp back is a single ioctl, so there is no end
+** point cache; ioctls take effect at once, so there is nothing to flush
+** or to lock. Setting ramps needs DRM master or no master on the device
+** (as on a kiosk without a display server).
+*/
+
+static struct {
+  int fd;             /* device (-1 if not open) */
+  drmModeRes *res;    /* mode resources of 'fd' */
+  double *hz;         /* refresh rate of each CRTC (see 'drminfo') */
+  uint32_t vblanked;  /* serial of the last vblank event */
+} drm = { -1, NULL, NULL, 0 };
+
+
+static int drmopen (const char *path) {
+  if (path == NULL)
+    path = DRM_DEVICE;
+  if ((drm.fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+    logerror("cannot open '%s': %s", path, strerror(errno));
+    return 0; /* fail */
+  } else if (!(drm.res = drmModeGetResources(drm.fd))) {
+    logerror("'%s' has no mode resources (not a KMS device?)", path);
+    close(drm.fd);
+    drm.fd = -1;
+    return 0; /* fail */
+  }
+  return 1; /* ok */
+}
+
+
+static void drmclose (void) {
+  drmModeFreeResources(drm.res);
+  free(drm.hz);
+  close(drm.fd);
+  drm.res = NULL;
+  drm.hz = NULL;
+  drm.fd = -1;
+}
+
+
+static int drmnscreen (Display *dpy) {
+  (void)dpy; /* unused */
+  return 1; /* (the device) */
+}
+
+
+static void drmcrtcs (Display *dpy, scrctx *sc, int iscreen) {
+  (void)dpy; (void)iscreen; /* unused */
+  sc->ncrtc = drm.res->count_crtcs;
+}
+
+
+/* index of the CRTC used by connector 'conn' (-1 if none) */
+static int drmconncrtc (const drmModeConnector *conn) {
+  drmModeEncoder *enc;
+  int c = -1;
+  if (conn->encoder_id && (enc = drmModeGetEncoder(drm.fd, conn->encoder_id))) {
+    for (int k = 0; k < drm.res->count_crtcs; k++)
+      if (drm.res->crtcs[k] == enc->crtc_id)
+        c = k;
+    drmModeFreeEncoder(enc);
+  }
+  return c;
+}
+
+
+/* refresh rate of 'mode' in Hz (0.0 if unknown) */
+static double drmmodehz (const drmModeModeInfo *mode) {
+  double vtotal = (double)mode->vtotal;
+  if (mode->htotal == 0 || mode->vtotal == 0)
+    return 0.0;
+  if (mode->flags & DRM_MODE_FLAG_DBLSCAN) vtotal *= 2.0;
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE) vtotal /= 2.0;
+  return (double)mode->clock * 1000.0 / ((double)mode->htotal * vtotal);
+}
+
+
+/*
+** Get the modes and ramp sizes of the CRTCs; the active ones have a mode
+** and drive a connected connector.
+*/
+static void drminfo (Display *dpy, scrctx *sc) {
+  statmark m;
+  statbegin(dpy, &m);
+  free(drm.hz);
+  drm.hz = calloc((size_t)MAX(sc->ncrtc, 1), sizeof(double));
+  for (int c = 0; c < sc->ncrtc; c++)
+    sc->crtc[c].active = 0;
+  for (int i = 0; i < drm.res->count_connectors; i++) { /* (no probing) */
+    drmModeConnector *conn;
+    int c;
+    if (!(conn = drmModeGetConnectorCurrent(drm.fd, drm.res->connectors[i])))
+      continue;
+    if (conn->connection == DRM_MODE_CONNECTED && (c = drmconncrtc(conn)) >= 0)
+      sc->crtc[c].active = 1; /* (if it also has a mode) */
+    drmModeFreeConnector(conn);
+  }
+  for (int c = 0; c < sc->ncrtc; c++) {
+    drmModeCrtc *crtc = drmModeGetCrtc(drm.fd, drm.res->crtcs[c]);
+    crtcstate *cs = &sc->crtc[c];
+    int valid = (crtc && crtc->mode_valid);
+    cs->mode = valid ? (RRMode)(c + 1) : None; /* (rate is in 'drm.hz') */
+    cs->active = cs->active && valid;
+    if (crtc && cs->gammasize == 0)
+      cs->gammasize = (crtc->gamma_size > 0) ? crtc->gamma_size : -1;
+    if (valid && drm.hz)
+      drm.hz[c] = drmmodehz(&crtc->mode);
+    if (cs->active)
+      sc->live[sc->nlive++] = c;
+    drmModeFreeCrtc(crtc);
+  }
+  statend(dpy, &m, "info", ctxindex(sc), -1);
+}
+
+
+/* get the ramp sizes that 'drminfo' did not get */
+static void drmsizes (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  (void)dpy; /* unused */
+  for (int i = 0; i < ncrtc; i++) {
+    crtcstate *cs = &sc->crtc[ic[i]];
+    if (cs->gammasize == 0) {
+      drmModeCrtc *crtc = drmModeGetCrtc(drm.fd, drm.res->crtcs[ic[i]]);
+      cs->gammasize = (crtc && crtc->gamma_size > 0) ? crtc->gamma_size : -1;
+      drmModeFreeCrtc(crtc);
+    }
+  }
+}
+
+
+/* read the ramps of the CRTCs in 'ic' whose end points are unknown */
+static void drmramps (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  int nreq = 0;
+  statmark m;
+  statbegin(dpy, &m);
+  drmsizes(dpy, sc, ic, ncrtc);
+  for (int i = 0; i < ncrtc; i++) {
+    const int c = ic[i];
+    crtcstate *cs = &sc->crtc[c];
+    size_t size = (size_t)cs->gammasize;
+    uint16_t *r;
+    if (cs->known || cs->gammasize < 0)
+      continue;
+    if (!(r = malloc(sizeof(uint16_t) * 3 * size))) {
+      logerror("cannot allocate ramp");
+      break;
+    }
+    if (drmModeCrtcGetGamma(drm.fd, drm.res->crtcs[c], (uint32_t)size, r,
+                            r + size, r + 2 * size) == 0)
+      setlast(sc, c, cs->gammasize, r, r + size, r + 2 * size);
+    else /* CRTC has no ramp */
+      cs->gammasize = -1;
+    free(r);
+    nreq++;
+  }
+  if (nreq > 0)
+    statend(dpy, &m, "ramps", ctxindex(sc), -1);
+}
+
+
+static void drmset (Display *dpy, scrctx *sc, int c,
+                    XRRCrtcGamma *xrr_gamma) {
+  (void)dpy; (void)sc; /* unused */
+  if (drmModeCrtcSetGamma(drm.fd, drm.res->crtcs[c],
+                          (uint32_t)xrr_gamma->size, xrr_gamma->red,
+                          xrr_gamma->green, xrr_gamma->blue) != 0)
+    logerror("cannot set the ramp of CRTC %d: %s", c, strerror(errno));
+}
+
+
+/* get the connectors, named as by the kernel (e.g. "HDMI-A-1") */
+static int drmoutputs (Display *dpy, scrctx *sc, outinfo **out) {
+  int nout = 0;
+  (void)dpy; (void)sc; /* unused */
+  *out = NULL;
+  if (drm.res->count_connectors == 0)
+    return 0;
+  if (!(*out = malloc((size_t)drm.res->count_connectors * sizeof(outinfo)))) {
+    logwarn("cannot allocate outputs");
+    return 0;
+  }
+  for (int i = 0; i < drm.res->count_connectors; i++) {
+    drmModeConnector *conn;
+    const char *type;
+    outinfo *oi = &(*out)[nout];
+    if (!(conn = drmModeGetConnectorCurrent(drm.fd, drm.res->connectors[i])))
+      continue;
+    type = drmModeGetConnectorTypeName(conn->connector_type);
+    if (snprintf(oi->name, sizeof(oi->name), "%s-%u", type ? type : "Unknown",
+                 (unsigned)conn->connector_type_id) < (int)sizeof(oi->name)) {
+      oi->crtc = drmconncrtc(conn); /* (-1 if disabled) */
+      nout++;
+    }
+    drmModeFreeConnector(conn);
+  }
+  return nout;
+}
+
+
+static double drmrefresh (scrctx *sc, int c) {
+  (void)sc; /* unused */
+  return (drm.hz) ? drm.hz[c] : 0.0;
+}
+
+
+/* ask for a vblank event of the first active CRTC (its pipe is its index) */
+static int drmvblank (Display *dpy, scrctx *sc) {
+  static uint32_t serial = 0;
+  drmVBlank vbl;
+  unsigned pipe;
+  (void)dpy; /* unused */
+  if (sc->nlive == 0)
+    return 0;
+  pipe = (unsigned)sc->live[0];
+  memset(&vbl, 0, sizeof(vbl));
+  vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+                     ((pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+                      DRM_VBLANK_HIGH_CRTC_MASK));
+  vbl.request.sequence = 1; /* (the next one) */
+  vbl.request.signal = sc->vserial = ++serial;
+  return (drmWaitVBlank(drm.fd, &vbl) == 0);
+}
+
+
+static void drmonvblank (int fd, unsigned int seq, unsigned int sec,
+                         unsigned int usec, void *data) {
+  (void)fd; (void)seq; (void)sec; (void)usec; /* unused */
+  drm.vblanked = (uint32_t)(uintptr_t)data; /* (the request's 'signal') */
+}
+
+
+static int drmvblanked (Display *dpy, scrctx *sc) {
+  struct pollfd pfd;
+  (void)dpy; /* unused */
+  pfd.fd = drm.fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) { /* have events? */
+    drmEventContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.version = 2; /* (up to 'page_flip_handler') */
+    ctx.vblank_handler = drmonvblank;
+    drmHandleEvent(drm.fd, &ctx); /* (reads all queued events) */
+  }
+  return (drm.vblanked == sc->vserial);
+}
+
+
+static int drmfd (Display *dpy) {
+  (void)dpy; /* unused */
+  return drm.fd;
+}
+
+
+static void drmnop (Display *dpy) {
+  (void)dpy; /* unused */
+}
+
+
+static void drmnopctx (Display *dpy, scrctx *sc) {
+  (void)dpy; (void)sc; /* unused */
+}
+
+
+static const backend drmbackend = {
+  drmnscreen, drmcrtcs, drminfo, drmsizes, drmramps, drmset, drmnop,
+  drmoutputs, drmrefresh, drmvblank, drmvblanked, drmfd, drmnopctx, drmnopctx,
+  drmnop, drmnop, drmnopctx
+};
+
+#endif
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Calibration
+** ======================================================================= */
+
+/*
+** A calibration is a per-channel curve measured for one output. It is
+** kept in 'caldir' as the binary file 'OUTPUT.lut' (see 'importcal'):
+** a 'calhdr' followed by the red, green and blue curves of 'n' native
+** endian unsigned shorts each. The files are mapped, never parsed, and
+** a CRTC driving 'OUTPUT' gets ramps of the temperature multipliers
+** passed through its curves (see 'fillcal').
+*/
+
+#define CAL_MAGIC     "XSCTCAL1"
+#define CAL_EXT       ".lut"
+#define CAL_MAX       65536  /* entries per channel */
+
+typedef struct calhdr {
+  char magic[8];      /* 'CAL_MAGIC' (not terminated) */
+  uint32_t n;         /* entries per channel */
+  uint32_t reserved;
+} calhdr;
+
+typedef struct calib {
+  struct calib *next;         /* (list of mapped calibrations) */
+  const unsigned short *lut;  /* red, green and blue curves */
+  size_t n;                   /* entries per curve */
+  void *map;                  /* mapped file */
+  size_t maplen;
+  char path[1];               /* (allocated with the structure) */
+} calib;
+
+
+static calib *cals = NULL;  /* calibrations mapped so far */
+
+
+/*
+** Get the calibrations directory into 'buf'. (As for 'runtimepath',
+** this is the directory of the process, not of a daemon client.)
+*/
+static int caldir (char *buf, size_t size) {
+  const char *cfg = getenv("XDG_CONFIG_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (cfg && *cfg)
+    n = snprintf(buf, size, "%s/xsct", cfg);
+  else if (home && *home)
+    n = snprintf(buf, size, "%s/.config/xsct", home);
+  else
+    return 0; /* no directory */
+  return (n > 0 && (size_t)n < size);
+}
+
+
+/* map the calibration file 'path' (once) */
+static const calib *mapcal (const char *path) {
+  const calhdr *hdr;
+  struct stat st;
+  calib *cal;
+  void *p;
+  int fd;
+  for (cal = cals; cal; cal = cal->next)
+    if (strcmp(cal->path, path) == 0)
+      return cal;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+    logwarn("cannot open calibration '%s': %s", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  } else if ((size_t)st.st_size < sizeof(calhdr)) {
+    logwarn("calibration '%s' is truncated", path);
+    close(fd);
+    return NULL;
+  }
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    logwarn("cannot map calibration '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+  hdr = p;
+  if (memcmp(hdr->magic, CAL_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->n < 2 || hdr->n > CAL_MAX ||
+      (size_t)st.st_size < sizeof(calhdr) + 3 * sizeof(short) * hdr->n) {
+    logwarn("'%s' is not an xsct calibration", path);
+    munmap(p, (size_t)st.st_size);
+    return NULL;
+  } else if (!(cal = malloc(sizeof(calib) + strlen(path)))) {
+    logwarn("cannot allocate calibration");
+    munmap(p, (size_t)st.st_size);
+    return NULL;
+  }
+  cal->lut = (const unsigned short *)(hdr + 1);
+  cal->n = hdr->n;
+  cal->map = p;
+  cal->maplen = (size_t)st.st_size;
+  strcpy(cal->path, path);
+  cal->next = cals;
+  cals = cal;
+  return cal;
+}
+
+
+static void freecals (void) {
+  while (cals) {
+    calib *next = cals->next;
+    munmap(cals->map, cals->maplen);
+    free(cals);
+    cals = next;
+  }
+}
+
+
+/* give the CRTCs of 'sc' the calibrations of their outputs (once) */
+static void calibrate (Display *dpy, scrctx *sc) {
+  char dir[PATH_MAX], path[PATH_MAX];
+  outinfo *out = NULL;
+  int nout = -1;  /* (outputs not fetched yet) */
+  struct dirent *e;
+  DIR *d;
+  if (sc->calread)
+    return;
+  sc->calread = 1;
+  for (int c = 0; c < sc->ncrtc; c++) /* (kept by 'refreshctx') */
+    sc->crtc[c].cal = NULL;
+  if (!caldir(dir, sizeof(dir)) || !(d = opendir(dir)))
+    return; /* no calibrations */
+  while ((e = readdir(d)) != NULL) {
+    size_t l = strlen(e->d_name);
+    const calib *cal;
+    int c = -2;
+    if (l <= strlen(CAL_EXT) || l - strlen(CAL_EXT) >= sizeof(out->name) ||
+        strcmp(e->d_name + l - strlen(CAL_EXT), CAL_EXT) != 0)
+      continue; /* not a calibration */
+    if (nout < 0) /* first calibration? */
+      nout = be->outputs(dpy, sc, &out);
+    for (int k = 0; k < nout && c == -2; k++)
+      if (strncmp(out[k].name, e->d_name, l - strlen(CAL_EXT)) == 0 &&
+          out[k].name[l - strlen(CAL_EXT)] == '\0')
+        c = out[k].crtc;
+    if (c < 0)
+      continue; /* output is not on this screen or disabled */
+    if (snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) <
+        (int)sizeof(path) && (cal = mapcal(path))) {
+      if (verbose)
+        loginfo("using calibration '%s' for CRTC %d of screen %d", path, c,
+                ctxindex(sc));
+      sc->crtc[c].cal = cal;
+    }
+  }
+  closedir(d);
+  free(out);
+}
+
+
+/* input level (0 to 'GAMMA_MULT') giving 'v' on channel 'ch' of 'cal' */
+static double uncal (const calib *cal, int ch, unsigned short v) {
+  const unsigned short *p = cal->lut + (size_t)ch * cal->n;
+  size_t lo = 0, hi = cal->n - 1;
+  if (v <= p[lo])
+    return 0.0;
+  else if (v >= p[hi])
+    return GAMMA_MULT;
+  while (hi - lo > 1) { /* (curves are nondecreasing) */
+    size_t mid = lo + (hi - lo) / 2;
+    if (p[mid] <= v) lo = mid;
+    else hi = mid;
+  }
+  return GAMMA_MULT * ((double)lo + (double)(v - p[lo]) /
+                       (double)(p[hi] - p[lo])) / (double)(cal->n - 1);
+}
+
+
+/*
+** Fill 'xrr_gamma' like 'fillramp' (or 'fillpow' with power table 'pw'
+** if not 'NULL'), passing each value through 'cal'.
+*/
+static void fillcal (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                     const calib *cal, const double *pw) {
+  const double m[3] = { sg.red, sg.green, sg.blue };
+  unsigned short *out[3];
+  const int size = xrr_gamma->size;
+  const size_t last = cal->n - 1;
+  out[0] = xrr_gamma->red;
+  out[1] = xrr_gamma->green;
+  out[2] = xrr_gamma->blue;
+  for (int ch = 0; ch < 3; ch++) {
+    const unsigned short *p = cal->lut + (size_t)ch * cal->n;
+    const double step = b * m[ch] * (double)last / (double)size;
+    const double scale = b * m[ch] * (double)last / GAMMA_MULT;
+    for (int i = 0; i < size; i++) {
+      const double x = pw ? scale * pw[i] : step * (double)i;
+      const size_t k = (size_t)x;
+      if (k >= last)
+        out[ch][i] = p[last];
+      else
+        out[ch][i] = (unsigned short)(p[k] + (x - (double)k) *
+                                      ((double)p[k + 1] - p[k]) + 0.5);
+    }
+  }
+}
+
+
+/* create directory 'dir' and its parents */
+static int mkdirs (const char *dir) {
+  char p[PATH_MAX];
+  size_t l = strlen(dir);
+  if (l >= sizeof(p))
+    return 0;
+  memcpy(p, dir, l + 1);
+  for (char *s = p + 1; *s; s++) {
+    if (*s == '/') {
+      *s = '\0';
+      if (mkdir(p, 0755) < 0 && errno != EEXIST)
+        return 0;
+      *s = '/';
+    }
+  }
+  return (mkdir(p, 0755) == 0 || errno == EEXIST);
+}
+
+
+/*
+** Convert the ArgyllCMS calibration 'path' (a '.cal' file, as written
+** by 'dispcal') into the calibration of output 'name' in 'caldir'. A
+** running daemon uses it after a restart.
+*/
+static void importcal (const char *path, const char *name) {
+  char dir[PATH_MAX], out[PATH_MAX], tmp[PATH_MAX], line[256];
+  unsigned short *v = NULL;
+  size_t n = 0, cap = 0;
+  int indata = 0, ok = 0;
+  calhdr hdr;
+  FILE *f;
+  if (name == NULL || strchr(name, '/')) {
+    logerror("--import-cal needs the output name (-o NAME)");
+    return;
+  } else if (!caldir(dir, sizeof(dir)) ||
+             snprintf(out, sizeof(out), "%s/%s%s", dir, name, CAL_EXT) >=
+             (int)sizeof(out) ||
+             snprintf(tmp, sizeof(tmp), "%s.tmp", out) >= (int)sizeof(tmp)) {
+    logerror("no calibration directory (set HOME or XDG_CONFIG_HOME)");
+    return;
+  } else if (!(f = fopen(path, "r"))) {
+    logerror("cannot open '%s': %s", path, strerror(errno));
+    return;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    double in, rgb[3];
+    if (!indata) /* (skip the header up to the data) */
+      indata = (strncmp(line, "BEGIN_DATA", 10) == 0 &&
+                isspace((unsigned char)line[10]));
+    else if (strncmp(line, "END_DATA", 8) == 0)
+      break;
+    else if (sscanf(line, "%lf %lf %lf %lf", &in, &rgb[0], &rgb[1],
+                    &rgb[2]) == 4 && n < CAL_MAX) {
+      if (n == cap) {
+        unsigned short *nv = realloc(v, sizeof(short) * 3 * (cap + 256));
+        if (nv == NULL) break;
+        v = nv;
+        cap += 256;
+      }
+      for (int ch = 0; ch < 3; ch++) /* (interleaved while reading) */
+        v[3 * n + ch] = (unsigned short)(trimdouble(rgb[ch], 0.0, 1.0) *
+                                         GAMMA_MULT + 0.5);
+      n++;
+    }
+  }
+  fclose(f);
+  if (n < 2)
+    logerror("'%s' has no calibration data (expected an ArgyllCMS .cal)",
+             path);
+  else if (mkdirs(dir) && (f = fopen(tmp, "wb"))) {
+    memcpy(hdr.magic, CAL_MAGIC, sizeof(hdr.magic));
+    hdr.n = (uint32_t)n;
+    hdr.reserved = 0;
+    ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+    for (int ch = 0; ch < 3; ch++)
+      for (size_t i = 0; ok && i < n; i++)
+        ok = (fwrite(&v[3 * i + ch], sizeof(short), 1, f) == 1);
+    ok = (fclose(f) == 0) && ok && rename(tmp, out) == 0;
+    if (!ok) {
+      logerror("cannot write '%s': %s", out, strerror(errno));
+      unlink(tmp);
+    } else if (verbose)
+      loginfo("imported %zu entries into '%s'", n, out);
+  } else
+    logerror("cannot create '%s': %s", tmp, strerror(errno));
+  free(v);
+}
+
+/* }===================================================================== */
+
+
+/*
+** Read 'XSCT_PROPERTY' of 'sc' (once) along with the ramp of one CRTC,
+** the probe: the one selected by 'icrtc' or else the first. Reading all
+** of the ramps would cost as much as not having the property, but other
+** programs set the ramps of every CRTC at once, so if the probe still
+** has the recorded ramp the other entries are trusted to be current as
+** well (see 'readprop'). The probe is requested before anything is
+** waited for, so its reply arrives with the CRTC infos and the property.
+*/
+static void loadcache (Display *dpy, scrctx *sc, int icrtc) {
+  int c = ((unsigned)icrtc < (unsigned)sc->ncrtc) ? icrtc : 0;
+  if (sc->propread || sc->ncrtc == 0)
+    return;
+  if (!sc->crtc[c].known) { /* (else it was set, or read, by this process) */
+    be->ramps(dpy, sc, &c, 1);
+    sc->probe = sc->crtc[c].known ? c : -1;
+  }
+  be->readcache(dpy, sc);
+}
+
+
+/*
+** Add the known end points of 'cs' to 'sg' (those of the uncalibrated
+** ramp). Returns whether they are known.
+*/
+static int crtcgamma (const crtcstate *cs, sgamma *sg) {
+  if (!cs->known)
+    return 0;
+  else if (cs->cal) {
+    sg->red += uncal(cs->cal, 0, cs->last[0]);
+    sg->green += uncal(cs->cal, 1, cs->last[1]);
+    sg->blue += uncal(cs->cal, 2, cs->last[2]);
+  } else {
+    sg->red += cs->last[0];
+    sg->green += cs->last[1];
+    sg->blue += cs->last[2];
+  }
+  return 1;
+}
+
+
+static int getscreengamma (Display *dpy, scrctx *sc, int icrtc, sgamma *sg) {
+  const int *ic;
+  int ncrtc, n = 0;
+  calibrate(dpy, sc);
+  loadcache(dpy, sc, icrtc);
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  be->ramps(dpy, sc, ic, ncrtc); /* (missing, stale or foreign entries) */
+  sg->red = sg->green = sg->blue = 0.0;
+  for (int i = 0; i < ncrtc; i++)
+    n += crtcgamma(&sc->crtc[ic[i]], sg);
+  return n;
+}
+
+
+/* estimate the state from the sum 'sg' of the end points of 'ncrtc' CRTCs */
+static tempstate gammatemp (sgamma sg, int ncrtc) {
+  double t;
+  tempstate ts;
+  ts.brightness = MAX(sg.red, sg.green);
+  ts.brightness = MAX(sg.blue, ts.brightness);
+  if (ts.brightness > 0.0 && ncrtc > 0) { /* need median? */
+    double gdelta;
+    sg.red /= ts.brightness;
+    sg.green /= ts.brightness;
+    sg.blue /= ts.brightness;
+    ts.brightness /= ncrtc;
+    ts.brightness /= BRIGHTNESS_DIV;
+    ts.brightness = trimdouble(ts.brightness, 0.0, 1.0);
+    if (verbose)
+      logGamma(sg, ts.brightness);
+    gdelta = sg.blue - sg.red;
+    if (gdelta < 0.0) {
+      if (sg.blue > 0.0) {
+        t = exp((sg.green + 1.0 + gdelta - (GAMMA_K0GR + GAMMA_K0BR)) /
+                (GAMMA_K1GR + GAMMA_K1BR)) +
+            MINTEMP;
+      } else {
+        t = (sg.green > 0.0) ?
+              (exp((sg.green - GAMMA_K0GR) / GAMMA_K1GR) + MINTEMP) :
+              MINTEMP;
+      }
+    } else {
+      t = exp((sg.green + 1.0 - gdelta - (GAMMA_K0GB + GAMMA_K0RB)) /
+              (GAMMA_K1GB + GAMMA_K1RB)) +
+          (TEMP_NORM - MINTEMP);
+    }
+  } else {
+    t = 0.0;
+    ts.brightness = trimdouble(ts.brightness, 0.0, 1.0);
+  }
+  ts.temp = (long)(t + 0.5);
+  return ts;
+}
+
+
+/*
+** Get screen temp: the exact state recorded with the ramps if all of the
+** CRTCs selected by 'icrtc' share one, otherwise estimated from them.
+*/
+static tempstate getst (Display *dpy, scrctx *sc, int icrtc) {
+  sgamma sg = { 0 };
+  int ncrtc = getscreengamma(dpy, sc, icrtc, &sg);
+  const crtcstate *first = NULL;
+  const int *ic;
+  int n = selcrtcs(dpy, sc, icrtc, &ic), i = 0;
+  for (; i < n; i++) {
+    const crtcstate *cs = &sc->crtc[ic[i]];
+    if (cs->gammasize < 0) /* (no ramp, not in the estimate either) */
+      continue;
+    else if (!hasst(cs) || (first && (cs->st.temp != first->st.temp ||
+                                      cs->st.brightness !=
+                                      first->st.brightness)))
+      break;
+    if (!first)
+      first = cs;
+  }
+  if (first && i == n) { /* exact? */
+    if (verbose)
+      loginfo("screen %d has the recorded %ldK %g", ctxindex(sc),
+              first->st.temp, first->st.brightness);
+    return first->st;
+  }
+  return gammatemp(sg, ncrtc);
+}
+
+
+#define samest(a, b)  ((a).temp == (b).temp && (a).brightness == (b).brightness)
+
+
+/* some CRTC of 'sc' has a state set by this process (see 'keepst') */
+static int anyapplied (const scrctx *sc) {
+  for (int c = 0; c < sc->ncrtc; c++)
+    if (sc->crtc[c].applied)
+      return 1;
+  return 0;
+}
+
+/*
+** Get the state of the CRTCs selected by 'icrtc'. This is the state last
+** set on them (see 'keepst') if they all share it, so a daemon does not
+** read their ramps again; otherwise it is estimated from the ramps.
+*/
+static tempstate knownst (Display *dpy, scrctx *sc, int icrtc) {
+  const int *ic;
+  int ncrtc, i = 0;
+  if (!anyapplied(sc)) /* (probe along with the CRTC infos) */
+    return getst(dpy, sc, icrtc);
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  while (i < ncrtc && sc->crtc[ic[i]].applied &&
+         samest(sc->crtc[ic[i]].ts, sc->crtc[ic[0]].ts))
+    i++;
+  return (ncrtc > 0 && i == ncrtc) ? sc->crtc[ic[0]].ts :
+                                     getst(dpy, sc, icrtc);
+}
+
+
+/*
+** Ramp kernels.
+** Each lane performs exactly the same sequence of double operations as
+** the scalar loop in 'fillramp' (including the truncating conversion), so
+** vectorized ramps are bit-identical to the scalar ones.
+*/
+
+#if defined(__AVX__) || defined(__SSE2__)
+
+/* store 8 int32 ramp values (in 'lo' and 'hi') as unsigned shorts */
+static void storeramp8 (unsigned short *p, __m128i lo, __m128i hi) {
+  const __m128i bias = _mm_set1_epi32(32768);
+  /* (SSE2 has only signed saturation, so pack in the signed range) */
+  __m128i v = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+  _mm_storeu_si128((__m128i *)p, _mm_xor_si128(v, _mm_set1_epi16(-32768)));
+}
+
+#endif
+
+
+#if defined(__AVX__)
+
+#define RAMPSTEP    8
+
+static void rampchannel (unsigned short *p, const __m256d *g, double m) {
+  const __m256d vm = _mm256_set1_pd(m), half = _mm256_set1_pd(0.5);
+  __m128i lo = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(g[0], vm), half));
+  __m128i hi = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(g[1], vm), half));
+  storeramp8(p, lo, hi);
+}
+
+/* fill the first 'size' rounded down to 'RAMPSTEP' entries */
+static int rampkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b) {
+  const __m256d gb = _mm256_set1_pd(GAMMA_MULT * b);
+  const __m256d vsize = _mm256_set1_pd((double)xrr_gamma->size);
+  const __m256d four = _mm256_set1_pd(4.0);
+  __m256d vi = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    __m256d g[2];
+    g[0] = _mm256_div_pd(_mm256_mul_pd(gb, vi), vsize);
+    vi = _mm256_add_pd(vi, four);
+    g[1] = _mm256_div_pd(_mm256_mul_pd(gb, vi), vsize);
+    vi = _mm256_add_pd(vi, four);
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+/* like 'rampkernel', following the power table 'pw' (see 'fillpow') */
+static int powkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                      const double *pw) {
+  const __m256d vb = _mm256_set1_pd(b);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    __m256d g[2];
+    g[0] = _mm256_mul_pd(vb, _mm256_loadu_pd(pw + i));
+    g[1] = _mm256_mul_pd(vb, _mm256_loadu_pd(pw + i + 4));
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+#elif defined(__SSE2__)
+
+#define RAMPSTEP    8
+
+static void rampchannel (unsigned short *p, const __m128d *g, double m) {
+  const __m128d vm = _mm_set1_pd(m), half = _mm_set1_pd(0.5);
+  __m128i v[4];
+  for (int k = 0; k < 4; k++) /* (2 values each) */
+    v[k] = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(g[k], vm), half));
+  storeramp8(p, _mm_unpacklo_epi64(v[0], v[1]), _mm_unpacklo_epi64(v[2], v[3]));
+}
+
+/* fill the first 'size' rounded down to 'RAMPSTEP' entries */
+static int rampkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b) {
+  const __m128d gb = _mm_set1_pd(GAMMA_MULT * b);
+  const __m128d vsize = _mm_set1_pd((double)xrr_gamma->size);
+  const __m128d two = _mm_set1_pd(2.0);
+  __m128d vi = _mm_set_pd(1.0, 0.0);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    __m128d g[4];
+    for (int k = 0; k < 4; k++) {
+      g[k] = _mm_div_pd(_mm_mul_pd(gb, vi), vsize);
+      vi = _mm_add_pd(vi, two);
+    }
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+/* like 'rampkernel', following the power table 'pw' (see 'fillpow') */
+static int powkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                      const double *pw) {
+  const __m128d vb = _mm_set1_pd(b);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    __m128d g[4];
+    for (int k = 0; k < 4; k++)
+      g[k] = _mm_mul_pd(vb, _mm_loadu_pd(pw + i + 2 * k));
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#define RAMPSTEP    4
+
+static void rampchannel (unsigned short *p, const float64x2_t *g, double m) {
+  const float64x2_t vm = vdupq_n_f64(m), half = vdupq_n_f64(0.5);
+  /* ('vcvtq_u64_f64' truncates, as the cast in 'fillramp') */
+  uint32x2_t lo = vmovn_u64(vcvtq_u64_f64(vaddq_f64(vmulq_f64(g[0], vm), half)));
+  uint32x2_t hi = vmovn_u64(vcvtq_u64_f64(vaddq_f64(vmulq_f64(g[1], vm), half)));
+  vst1_u16(p, vmovn_u32(vcombine_u32(lo, hi)));
+}
+
+/* fill the first 'size' rounded down to 'RAMPSTEP' entries */
+static int rampkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b) {
+  static const double i01[2] = { 0.0, 1.0 };
+  const float64x2_t gb = vdupq_n_f64(GAMMA_MULT * b);
+  const float64x2_t vsize = vdupq_n_f64((double)xrr_gamma->size);
+  const float64x2_t two = vdupq_n_f64(2.0);
+  float64x2_t vi = vld1q_f64(i01);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    float64x2_t g[2];
+    g[0] = vdivq_f64(vmulq_f64(gb, vi), vsize);
+    vi = vaddq_f64(vi, two);
+    g[1] = vdivq_f64(vmulq_f64(gb, vi), vsize);
+    vi = vaddq_f64(vi, two);
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+/* like 'rampkernel', following the power table 'pw' (see 'fillpow') */
+static int powkernel (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                      const double *pw) {
+  const float64x2_t vb = vdupq_n_f64(b);
+  int i = 0;
+  for (; i + RAMPSTEP <= xrr_gamma->size; i += RAMPSTEP) {
+    float64x2_t g[2];
+    g[0] = vmulq_f64(vb, vld1q_f64(pw + i));
+    g[1] = vmulq_f64(vb, vld1q_f64(pw + i + 2));
+    rampchannel(xrr_gamma->red + i, g, sg.red);
+    rampchannel(xrr_gamma->green + i, g, sg.green);
+    rampchannel(xrr_gamma->blue + i, g, sg.blue);
+  }
+  return i;
+}
+
+#else
+
+#define rampkernel(xrr_gamma, sg, b)    0  /* no vector kernel */
+#define powkernel(xrr_gamma, sg, b, pw)    0
+
+#endif
+
+
+/* fill gamma ramp 'xrr_gamma' for multipliers 'sg' and brightness 'b' */
+static void fillramp (XRRCrtcGamma *xrr_gamma, sgamma sg, double b) {
+  int size = xrr_gamma->size;
+  for (int i = rampkernel(xrr_gamma, sg, b); i < size; i++) { /* (rest) */
+    const double g = GAMMA_MULT * b * (double)i / (double)size;
+    xrr_gamma->red[i] = (unsigned short int)(g * sg.red + 0.5);
+    xrr_gamma->green[i] = (unsigned short int)(g * sg.green + 0.5);
+    xrr_gamma->blue[i] = (unsigned short int)(g * sg.blue + 0.5);
+  }
+}
+
+
+/*
+** Fill 'xrr_gamma' like 'fillramp', but along the curve of power table
+** 'pw' (see 'powtable') instead of the straight line.
+*/
+static void fillpow (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                     const double *pw) {
+  int size = xrr_gamma->size;
+  for (int i = powkernel(xrr_gamma, sg, b, pw); i < size; i++) { /* (rest) */
+    const double g = b * pw[i];
+    xrr_gamma->red[i] = (unsigned short int)(g * sg.red + 0.5);
+    xrr_gamma->green[i] = (unsigned short int)(g * sg.green + 0.5);
+    xrr_gamma->blue[i] = (unsigned short int)(g * sg.blue + 0.5);
+  }
+}
+
+
+/* {======================================================================
+** Ramp cache
+** ======================================================================= */
+
+/* number of recently generated ramps kept around */
+#if !defined(RAMPCACHE_SIZE)
+#define RAMPCACHE_SIZE      8
+#endif
+
+typedef struct ramp {
+  XRRCrtcGamma *xrr_gamma;  /* generated ramp ('NULL' if unused) */
+  const calib *cal;         /* calibration of 'xrr_gamma' */
+  double e;                 /* gamma exponent of 'xrr_gamma' */
+  long temp;                /* temperature of 'xrr_gamma' */
+  double brightness;        /* brightness of 'xrr_gamma' */
+  uint32_t hash;            /* 'ramphash' of 'xrr_gamma' */
+  unsigned long lastuse;    /* for LRU replacement */
+} ramp;
+
+
+/*
+** The ramps used while pinned (see 'pinramps') are not replaced; for more
+** of them than 'RAMPCACHE_SIZE' the cache grows until they are unpinned.
+*/
+static struct {
+  ramp *entries;        /* ramps ('RAMPCACHE_SIZE' unless pinned) */
+  int n;                /* number of elements in 'entries' */
+  unsigned long clock;  /* incremented on each use */
+  unsigned long pin;    /* ramps used since are pinned (0 if none) */
+  int npin;             /* nesting depth of 'pinramps' */
+} ramps = { NULL, 0, 0, 0, 0 };
+
+
+#define pinned(r)   (ramps.pin != 0 && (r)->lastuse >= ramps.pin)
+
+
+/*
+** Power tables. With a gamma exponent E other than 1 a ramp follows
+** (i/size)^(1/E) instead of i/size. The powers depend only on the ramp
+** size and E, so they are computed once per pair (a daemon keeps them)
+** and every ramp and fade frame only scales them (see 'fillpow').
+*/
+
+#if !defined(POWCACHE_SIZE)
+#define POWCACHE_SIZE       4
+#endif
+
+static struct {
+  struct {
+    double *t;    /* 'GAMMA_MULT * (i/size)^(1/e)' ('NULL' if unused) */
+    int size;
+    double e;
+  } entries[POWCACHE_SIZE];
+  int next;       /* entry replaced next (round robin) */
+} pows = { 0 };
+
+
+/* power table of 'size' entries for exponent 'e' ('NULL' on failure) */
+static const double *powtable (int size, double e) {
+  double *t;
+  int k = pows.next;
+  for (int i = 0; i < POWCACHE_SIZE; i++)
+    if (pows.entries[i].t && pows.entries[i].size == size &&
+        pows.entries[i].e == e)
+      return pows.entries[i].t;
+  if (!(t = malloc(sizeof(double) * (size_t)size))) {
+    logerror("cannot allocate power table");
+    return NULL;
+  }
+  for (int i = 0; i < size; i++)
+    t[i] = GAMMA_MULT * pow((double)i / (double)size, 1.0 / e);
+  free(pows.entries[k].t);
+  pows.entries[k].t = t;
+  pows.entries[k].size = size;
+  pows.entries[k].e = e;
+  pows.next = (k + 1) % POWCACHE_SIZE;
+  return t;
+}
+
+
+/* fill 'xrr_gamma' with gamma exponent 'e' through calibration 'cal' */
+static void fillgamma (XRRCrtcGamma *xrr_gamma, sgamma sg, double b,
+                       double e, const calib *cal) {
+  const double *pw = (e != 1.0) ? powtable(xrr_gamma->size, e) : NULL;
+  if (cal)
+    fillcal(xrr_gamma, sg, b, cal, pw);
+  else if (pw)
+    fillpow(xrr_gamma, sg, b, pw);
+  else /* (linear, or no memory for the table) */
+    fillramp(xrr_gamma, sg, b);
+}
+
+
+/*
+** Get ramp of 'size' entries for 'ts' with gamma exponent 'e' through
+** calibration 'cal' (if not 'NULL'), generating it only on cache miss.
+** Its hash, computed once with the ramp, goes to '*hash' if not 'NULL'.
+*/
+static XRRCrtcGamma *getramp (int size, const calib *cal, double e,
+                              tempstate ts, uint32_t *hash) {
+  double b = trimdouble(ts.brightness, 0.0, 1.0);
+  ramp *victim;
+  int k = -1;
+  for (int i = 0; i < ramps.n; i++) {
+    ramp *r = &ramps.entries[i];
+    if (r->xrr_gamma && r->xrr_gamma->size == size && r->temp == ts.temp &&
+        r->brightness == b && r->cal == cal && r->e == e) { /* hit? */
+      r->lastuse = ++ramps.clock;
+      if (hash) *hash = r->hash;
+      return r->xrr_gamma;
+    } else if (!pinned(r) && (k < 0 || r->lastuse < ramps.entries[k].lastuse))
+      k = i; /* least recently used */
+  }
+  if (ramps.n < RAMPCACHE_SIZE || k < 0) { /* room left or all pinned? */
+    ramp *entries = realloc(ramps.entries, sizeof(ramp) *
+                                           (size_t)(ramps.n + 1));
+    if (entries == NULL) {
+      logerror("cannot allocate ramp cache");
+      exit(EXIT_FAILURE);
+    }
+    ramps.entries = entries;
+    k = ramps.n++;
+    memset(&ramps.entries[k], 0, sizeof(ramp));
+  }
+  victim = &ramps.entries[k];
+  if (victim->xrr_gamma && victim->xrr_gamma->size != size) {
+    XRRFreeGamma(victim->xrr_gamma); /* (buffer is reused otherwise) */
+    victim->xrr_gamma = NULL;
+  }
+  if (victim->xrr_gamma == NULL)
+    victim->xrr_gamma = XRRAllocGamma(size);
+  fillgamma(victim->xrr_gamma, tempgamma(ts.temp), b, e, cal);
+  victim->hash = ramphash(size, victim->xrr_gamma->red,
+                          victim->xrr_gamma->green, victim->xrr_gamma->blue);
+  victim->cal = cal;
+  victim->e = e;
+  victim->temp = ts.temp;
+  victim->brightness = b;
+  victim->lastuse = ++ramps.clock;
+  if (hash) *hash = victim->hash;
+  return victim->xrr_gamma;
+}
+
+
+/*
+** Pin the ramps used from now on until the matching 'unpinramps' (if
+** 'on'), so the ramps generated before a grab are all still cached when
+** they are sent within it. Pins nest like grabs.
+*/
+static void pinramps (int on) {
+  if (on && ramps.npin++ == 0)
+    ramps.pin = ramps.clock + 1;
+}
+
+
+static void unpinramps (int on) {
+  if (on && --ramps.npin == 0) {
+    ramps.pin = 0;
+    while (ramps.n > RAMPCACHE_SIZE) { /* shrink back? */
+      int k = 0;
+      for (int i = 1; i < ramps.n; i++)
+        if (ramps.entries[i].lastuse < ramps.entries[k].lastuse)
+          k = i; /* least recently used */
+      if (ramps.entries[k].xrr_gamma)
+        XRRFreeGamma(ramps.entries[k].xrr_gamma);
+      ramps.entries[k] = ramps.entries[--ramps.n];
+    }
+  }
+}
+
+
+static void freeramps (void) {
+  for (int i = 0; i < ramps.n; i++)
+    if (ramps.entries[i].xrr_gamma)
+      XRRFreeGamma(ramps.entries[i].xrr_gamma);
+  free(ramps.entries);
+  ramps.entries = NULL;
+  ramps.n = 0;
+  for (int i = 0; i < POWCACHE_SIZE; i++) {
+    free(pows.entries[i].t);
+    pows.entries[i].t = NULL;
+  }
+}
+
+
+/* ramp of CRTC 'cs' for 'ts' (and its hash, see 'getramp') */
+#define crtcramp(cs, ts, h) \
+        getramp((cs)->gammasize, (cs)->cal, crtcexp(cs), ts, h)
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Server grab
+** ======================================================================= */
+
+/*
+** In '--atomic' mode the ramps are generated first and then sent within
+** a server grab, so the server handles them back to back and no other
+** client gets a request in between. The grab is released and flushed
+** right after the last ramp. Grabs nest, so a command setting several
+** screens or CRTCs takes one grab around all of them (see 'prepramps').
+*/
+
+static int grabs = 0;  /* nesting depth of 'grab' */
+
+
+static void grab (Display *dpy, int on) {
+  if (on && grabs++ == 0)
+    be->lock(dpy);
+}
+
+
+static void ungrab (Display *dpy, int on) {
+  if (on && --grabs == 0) {
+    be->unlock(dpy);
+    be->flush(dpy); /* (do not hold the grab until the next flush) */
+  }
+}
+
+/* }===================================================================== */
+
+
+/* generate the ramps of the CRTCs in 'ic' into the ramp cache */
+static void genramps (scrctx *sc, const int *ic, int ncrtc, tempstate ts) {
+  for (int i = 0; i < ncrtc; i++)
+    if (sc->crtc[ic[i]].gammasize > 0)
+      crtcramp(&sc->crtc[ic[i]], ts, NULL);
+}
+
+
+/*
+** Check whether CRTC 'c' already has the ramp of 'ts', judging by its
+** known end points and ramp hash (see 'XSCT_PROPERTY', whose entries
+** are checked by 'loadcache'); never with '--force'.
+*/
+static int hasramp (scrctx *sc, int c, tempstate ts) {
+  const crtcstate *cs = &sc->crtc[c];
+  XRRCrtcGamma *xrr_gamma;
+  uint32_t hash;
+  int n = cs->gammasize - 1;
+  if (force || !cs->known || n < 0 ||
+      !(xrr_gamma = crtcramp(cs, ts, &hash)))
+    return 0;
+  return (cs->hash == hash && cs->last[0] == xrr_gamma->red[n] &&
+          cs->last[1] == xrr_gamma->green[n] &&
+          cs->last[2] == xrr_gamma->blue[n]);
+}
+
+
+/* check whether all 'ncrtc' CRTCs in 'ic' have the ramp of 'ts' */
+static int uptodate (scrctx *sc, const int *ic, int ncrtc, tempstate ts) {
+  for (int i = 0; i < ncrtc; i++)
+    if (sc->crtc[ic[i]].gammasize >= 0 && !hasramp(sc, ic[i], ts))
+      return 0;
+  return 1;
+}
+
+
+/*
+** Do what setting 'ts' on the CRTCs selected by 'icrtc' needs from the
+** server and generate their ramps (see 'setramps'), returning whether
+** they already have them. In '--atomic' mode this is done for every set
+** before the grab, with the ramps pinned, so that within the grab
+** nothing is waited for or generated.
+*/
+static int prepramps (Display *dpy, scrctx *sc, int icrtc, tempstate ts) {
+  const int *ic;
+  int ncrtc;
+  calibrate(dpy, sc);
+  if (!force || atomic) /* (for 'hasramp', the sizes and 'writeprop') */
+    loadcache(dpy, sc, icrtc);
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  be->sizes(dpy, sc, ic, ncrtc);
+  genramps(sc, ic, ncrtc, ts); /* (before sending any of them) */
+  return uptodate(sc, ic, ncrtc, ts);
+}
+
+
+/*
+** Set the ramps of the CRTCs selected by 'icrtc' (see 'setst'), skipping
+** the CRTCs that already have them (their states are recorded anew: ramps
+** of different states may be the same). Returns the number of CRTCs whose
+** records changed, that is, whether 'XSCT_PROPERTY' is to be written.
+*/
+static int setramps (Display *dpy, scrctx *sc, int icrtc, tempstate ts) {
+  const int *ic;
+  int ncrtc, skip, n = 0;
+  if (verbose)
+    logGamma(tempgamma(ts.temp), trimdouble(ts.brightness, 0.0, 1.0));
+  skip = prepramps(dpy, sc, icrtc, ts);
+  if (skip && verbose)
+    loginfo("screen %d already has %ldK, not setting it", ctxindex(sc),
+            ts.temp);
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  grab(dpy, atomic && !skip);
+  for (int i = 0; i < ncrtc; i++) {
+    int c = ic[i];
+    crtcstate *cs = &sc->crtc[c];
+    XRRCrtcGamma *xrr_gamma;
+    uint32_t hash;
+    statmark m;
+    if (cs->gammasize < 0)
+      continue;
+    if (hasramp(sc, c, ts)) { /* nothing to send? */
+      uint32_t sthash = cs->sthash;
+      tempstate st = cs->st;
+      setlastst(sc, c, ts);
+      n += (cs->sthash != sthash || !samest(cs->st, st));
+      continue;
+    }
+    statbegin(dpy, &m);
+    xrr_gamma = crtcramp(cs, ts, &hash);
+    be->set(dpy, sc, c, xrr_gamma);
+    setlastramp(sc, c, xrr_gamma, hash);
+    setlastst(sc, c, ts);
+    statend(dpy, &m, "set", ctxindex(sc), c);
+    n++;
+  }
+  ungrab(dpy, atomic && !skip);
+  keepst(sc, icrtc, ts);
+  return n;
+}
+
+
+/* set screen temp */
+static void setst (Display *dpy, scrctx *sc, int icrtc, tempstate ts) {
+  if (setramps(dpy, sc, icrtc, ts) > 0) /* (cache is up to date otherwise) */
+    be->writecache(dpy, sc);
+}
+
+
+/* {======================================================================
+** Frame pacing
+** ======================================================================= */
+
+/*
+** Fade frames and coalesced updates are paced by the vertical blank of
+** the screen being updated when the backend reports it: after sending
+** ramps xsct asks for the next vblank and sends the following ones right
+** after it, so at most one update lands per refresh and it has almost a
+** whole frame to take effect before the scanout starts over. A timer
+** remains as a deadline, 'VSYNC_SLACK' periods after the expected vblank,
+** in case the notice does not come (e.g. for a disabled CRTC).
+*/
+
+/* fraction of a frame period to wait for a vblank past its expected time */
+#if !defined(VSYNC_SLACK)
+#define VSYNC_SLACK     0.5
+#endif
+
+static struct {
+  scrctx *sc;   /* screen waiting for its next vblank ('NULL' if none) */
+  int hit;      /* the vblank came (see 'vsynced') */
+  double t;     /* time it was asked for */
+} vsync = { NULL, 0, 0.0 };
+
+
+/* ask for the next vblank of 'sc' unless waiting for one already */
+static void vsyncarm (Display *dpy, scrctx *sc) {
+  if (vsync.sc == NULL && be->vblank(dpy, sc)) {
+    vsync.sc = sc;
+    vsync.hit = 0;
+    vsync.t = monotime();
+  }
+}
+
+
+/* forget the vblank asked for (it was used or is not needed anymore) */
+static void vsyncreset (void) {
+  vsync.sc = NULL;
+  vsync.hit = 0;
+}
+
+
+/* check whether the vblank asked for by 'vsyncarm' came */
+static int vsynced (Display *dpy) {
+  if (vsync.sc && !vsync.hit)
+    vsync.hit = be->vblanked(dpy, vsync.sc);
+  return vsync.hit;
+}
+
+
+/*
+** Milliseconds until an update due at time 'due' with frame period
+** 'period': 0 once the vblank came, or the deadline while waiting for it.
+*/
+static int vsynctimeout (Display *dpy, double due, double period) {
+  double dt;
+  if (vsynced(dpy))
+    return 0;
+  else if (vsync.sc) /* (the vblank is at most a period away) */
+    due = vsync.t + (1.0 + VSYNC_SLACK) * period;
+  dt = due - monotime();
+  return (dt > 0.0) ? (int)ceil(dt * 1000.0) : 0;
+}
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Fade
+** ======================================================================= */
+
+/*
+** Fades along the mired curves ('EASE_MIRED', 'EASE_SMOOTH') go in steps
+** of equal perceptual size rather than a frame per refresh: the number of
+** steps is the distance in mired (1e6/K, in which equal differences look
+** alike across the range) or in brightness divided by the step sizes
+** below, about one 8-bit level at the top of the ramps. A frame is only
+** generated and uploaded when the fade reaches the next step, and in
+** between xsct sleeps until it is due, so a long fade costs a ramp per
+** step however long it takes (short fades still get one per refresh).
+*/
+
+/* refresh rate used when it cannot be determined from the CRTC mode */
+#if !defined(FADE_HZ)
+#define FADE_HZ       60.0
+#endif
+
+/* perceptual step sizes in mired and in brightness */
+#if !defined(FADE_MIRED_STEP)
+#define FADE_MIRED_STEP     1.0
+#endif
+
+#if !defined(FADE_BRIGHT_STEP)
+#define FADE_BRIGHT_STEP    (1.0 / 256.0)
+#endif
+
+#define mired(temp)   (1e6 / (double)(temp))
+
+typedef struct fade {
+  scrctx *sc;                   /* context of the screen ('NULL' if idle) */
+  int *ic;                      /* indices of the fading CRTCs */
+  XRRCrtcGamma **ramps;         /* preallocated ramp for each CRTC (shared
+                                   between CRTCs with equal ramp size) */
+  int ncrtc;                    /* number of elements in 'ic' and 'ramps' */
+  tempstate from, to;
+  double start, dur;            /* start time and duration (in seconds) */
+  int ease;                     /* curve ('EASE_*') */
+  int nstep;                    /* number of steps (0 for one per frame) */
+  int step;                     /* step of the current frame */
+  double due;                   /* time of the next step */
+  int fresh;                    /* the current frame is a new step */
+  int last;                     /* the current frame is the last one */
+  int atomic;                   /* upload the frames within a server grab */
+} fade;
+
+
+static struct {
+  fade *screens;    /* fade state of each screen */
+  int nscreen;      /* number of elements in 'screens' */
+  int nactive;      /* number of fading screens */
+  double period;    /* frame period of the fastest fading CRTC */
+  double next;      /* time of the next frame */
+  int idle;         /* sleeping until 'next' as no step is due before */
+  scrctx *vsc;      /* screen of that CRTC (paces the frames) */
+} fades = { 0 };
+
+
+/* progress of curve 'e' at the fraction 't' of the duration */
+static double easeprog (int e, double t) {
+  return (e == EASE_SMOOTH) ? t * t * (3.0 - 2.0 * t) : t;
+}
+
+
+/* fraction of the duration at which curve 'e' reaches progress 'p' */
+static double easetime (int e, double p) {
+  return (e == EASE_SMOOTH) ? 0.5 - sin(asin(1.0 - 2.0 * p) / 3.0) : p;
+}
+
+
+/* number of perceptual steps from 'a' to 'b' (at least 1) */
+static int fadesteps (tempstate a, tempstate b) {
+  double dm = fabs(mired(b.temp) - mired(a.temp)) / FADE_MIRED_STEP;
+  double db = fabs(trimdouble(b.brightness, 0.0, 1.0) -
+                   trimdouble(a.brightness, 0.0, 1.0)) / FADE_BRIGHT_STEP;
+  return (int)ceil(MAX(MAX(dm, db), 1.0));
+}
+
+
+/* highest refresh rate of the CRTCs in 'ic' (0.0 if unknown) */
+static double refreshrate (Display *dpy, scrctx *sc, const int *ic, int n) {
+  double hz = 0.0;
+  fetchinfo(dpy, sc);
+  for (int i = 0; i < n; i++) {
+    double chz = be->refresh(sc, ic[i]);
+    hz = MAX(hz, chz);
+  }
+  return hz;
+}
+
+
+/* index of the first CRTC in 'f' using the same ramp as CRTC 'c' */
+static int sharedramp (const fade *f, int c) {
+  int i = 0;
+  while (f->ramps[i] != f->ramps[c])
+    i++;
+  return i;
+}
+
+
+static void fadestop (int iscreen) {
+  fade *f;
+  if (iscreen >= fades.nscreen || !(f = &fades.screens[iscreen])->sc)
+    return; /* not fading */
+  for (int c = 0; c < f->ncrtc; c++) {
+    if (sharedramp(f, c) == c) /* owns the ramp? */
+      XRRFreeGamma(f->ramps[c]);
+    f->sc->crtc[f->ic[c]].fading = 0;
+  }
+  free(f->ramps);
+  free(f->ic);
+  f->sc = NULL;
+  if (--fades.nactive == 0) {
+    fades.period = 0.0;
+    fades.idle = 0;
+  }
+}
+
+
+/* start fading screen 'iscreen' from its current state to 'ts' */
+static void fadeto (Display *dpy, int iscreen, int icrtc, tempstate ts) {
+  scrctx *sc = getctx(dpy, iscreen);
+  const int *ic;
+  double hz;
+  int ncrtc;
+  fade *f;
+  if (iscreen >= fades.nscreen) { /* first fade on this screen? */
+    int n = be->nscreen(dpy);
+    fade *screens = realloc(fades.screens, sizeof(fade) * (size_t)n);
+    if (screens == NULL) {
+      logerror("cannot allocate fade state");
+      return;
+    }
+    memset(screens + fades.nscreen, 0,
+           sizeof(fade) * (size_t)(n - fades.nscreen));
+    fades.screens = screens;
+    fades.nscreen = n;
+  }
+  buildtemplut(); /* (for the frames) */
+  f = &fades.screens[iscreen];
+  f->from = getst(dpy, sc, icrtc);
+  fadestop(iscreen); /* (after 'getst', so fades continue from midway) */
+  if (f->from.temp < MINTEMP) /* brightness was 0? */
+    f->from.temp = ts.temp; /* (only fade brightness) */
+  f->to = ts;
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  be->sizes(dpy, sc, ic, ncrtc);
+  if (uptodate(sc, ic, ncrtc, ts)) { /* nothing to fade? */
+    keepst(sc, icrtc, ts);
+    return;
+  }
+  f->ic = malloc(sizeof(int) * (size_t)MAX(ncrtc, 1));
+  f->ramps = malloc(sizeof(XRRCrtcGamma *) * (size_t)MAX(ncrtc, 1));
+  if (f->ic == NULL || f->ramps == NULL) {
+    free(f->ic);
+    free(f->ramps);
+    logerror("cannot allocate fade state");
+    return;
+  }
+  f->ncrtc = 0;
+  for (int k = 0; k < ncrtc; k++) {
+    int c = ic[k];
+    int size = sc->crtc[c].gammasize;
+    int i = 0;
+    if (size < 0) /* no ramp? */
+      continue;
+    while (i < f->ncrtc && (f->ramps[i]->size != size ||
+                            sc->crtc[f->ic[i]].cal != sc->crtc[c].cal ||
+                            crtcexp(&sc->crtc[f->ic[i]]) !=
+                            crtcexp(&sc->crtc[c])))
+      i++;
+    f->ramps[f->ncrtc] = (i < f->ncrtc) ? f->ramps[i] : XRRAllocGamma(size);
+    f->ic[f->ncrtc++] = c;
+    sc->crtc[c].fading = 1;
+  }
+  keepst(sc, icrtc, ts);
+  be->writecache(dpy, sc);
+  hz = refreshrate(dpy, sc, f->ic, f->ncrtc);
+  f->sc = sc;
+  if (hz <= 0.0)
+    hz = FADE_HZ;
+  f->start = monotime();
+  f->dur = (double)fade_ms / 1000.0;
+  f->atomic = atomic;
+  f->ease = ease;
+  f->nstep = (ease == EASE_LINEAR) ? 0 : fadesteps(f->from, f->to);
+  f->step = 0; /* (the current state) */
+  if (fades.nactive++ == 0 || 1.0 / hz < fades.period) {
+    fades.period = 1.0 / hz;
+    fades.next = f->start;
+    fades.vsc = sc;
+  }
+  if (fades.idle) { /* (wake up for this fade) */
+    fades.idle = 0;
+    fades.next = f->start;
+  }
+}
+
+
+/* calibration and gamma exponent of the 'c'th CRTC of 'f' (see 'keepst') */
+#define fadecal(f, c)     ((f)->sc->crtc[(f)->ic[c]].cal)
+#define fadeexp(f, c)     ((f)->sc->crtc[(f)->ic[c]].gamma)
+
+
+/*
+** Generate the frame of 'f' at time 'now' (uploaded by 'fadeupload'), if
+** it is a new step ('f->fresh'), and the time the next step is due.
+*/
+static void fadefill (fade *f, double now) {
+  double t = (f->dur > 0.0) ? (now - f->start) / f->dur : 1.0;
+  double p = t; /* (progress) */
+  tempstate ts = f->to;
+  double b;
+  sgamma sg;
+  f->fresh = 1;
+  f->due = now; /* (the next frame) */
+  if (t < 1.0 && f->nstep > 0) { /* in steps? */
+    int k = (int)floor(easeprog(f->ease, t) * f->nstep + 0.5);
+    f->fresh = (k != f->step);
+    f->step = k;
+    f->due = f->start + f->dur * easetime(f->ease, (k + 0.5) / f->nstep);
+    p = (double)k / f->nstep;
+    if (k >= f->nstep) /* (reached the target early) */
+      t = 1.0;
+    if (!f->fresh)
+      return;
+  }
+  if ((f->last = (t >= 1.0))) { /* last frame? */
+    for (int c = 0; c < f->ncrtc; c++) /* (keep target ramp in the cache) */
+      getramp(f->ramps[c]->size, fadecal(f, c), fadeexp(f, c), ts, NULL);
+    return;
+  }
+  if (f->ease == EASE_LINEAR) {
+    double dt = (double)(f->to.temp - f->from.temp);
+    ts.temp = f->from.temp + (long)floor(dt * p + 0.5);
+  } else {
+    double m = mired(f->from.temp) +
+               (mired(f->to.temp) - mired(f->from.temp)) * p;
+    ts.temp = (long)floor(1e6 / m + 0.5);
+  }
+  ts.brightness = f->from.brightness +
+                  (f->to.brightness - f->from.brightness) * p;
+  b = trimdouble(ts.brightness, 0.0, 1.0);
+  sg = lutgamma(ts.temp);
+  for (int c = 0; c < f->ncrtc; c++)
+    if (sharedramp(f, c) == c) /* not filled in this frame yet? */
+      fillgamma(f->ramps[c], sg, b, fadeexp(f, c), fadecal(f, c));
+}
+
+
+/* upload the frame generated by 'fadefill' */
+static void fadeupload (Display *dpy, fade *f) {
+  if (!f->fresh) /* (same step as the last frame) */
+    return;
+  for (int c = 0; c < f->ncrtc; c++) {
+    XRRCrtcGamma *xrr_gamma = f->ramps[c];
+    uint32_t hash;
+    if (f->last)
+      xrr_gamma = getramp(xrr_gamma->size, fadecal(f, c), fadeexp(f, c),
+                          f->to, &hash);
+    else /* (frames are not cached) */
+      hash = ramphash(xrr_gamma->size, xrr_gamma->red, xrr_gamma->green,
+                      xrr_gamma->blue);
+    be->set(dpy, f->sc, f->ic[c], xrr_gamma);
+    setlastramp(f->sc, f->ic[c], xrr_gamma, hash); /* (see 'fading') */
+    if (f->last)
+      setlastst(f->sc, f->ic[c], f->to);
+  }
+}
+
+
+/* upload the current frame of every fading screen */
+static void fadestep (Display *dpy) {
+  double now = monotime();
+  double due = HUGE_VAL; /* next step of the fades still running */
+  int on = 0;
+  if (fades.idle && now >= fades.next) { /* a step is due? */
+    fades.idle = 0;
+    vsyncarm(dpy, fades.vsc); /* (upload it right after the next vblank) */
+    if (vsync.sc) {
+      be->flush(dpy);
+      fades.next = now + fades.period;
+      return;
+    }
+  }
+  vsyncreset(); /* (used for this frame, if it came) */
+  pinramps(1); /* (targets of the last frames stay cached) */
+  for (int i = 0; i < fades.nscreen; i++) { /* generate all frames first */
+    fade *f = &fades.screens[i];
+    if (f->sc) {
+      fadefill(f, now);
+      if (f->fresh)
+        on |= f->atomic;
+    }
+  }
+  grab(dpy, on);
+  for (int i = 0; i < fades.nscreen; i++)
+    if (fades.screens[i].sc)
+      fadeupload(dpy, &fades.screens[i]);
+  ungrab(dpy, on);
+  unpinramps(1);
+  for (int i = 0; i < fades.nscreen; i++) {
+    fade *f = &fades.screens[i];
+    if (f->sc && f->last) { /* done? */
+      scrctx *sc = f->sc;
+      fadestop(i); /* (records the CRTCs again) */
+      be->writecache(dpy, sc);
+    } else if (f->sc)
+      due = MIN(due, f->due);
+  }
+  fades.next += fades.period;
+  if (fades.next < now) /* missed frames? */
+    fades.next = now + fades.period; /* (do not try to catch up) */
+  if (fades.nactive > 0 && due > fades.next) { /* no step next frame? */
+    fades.next = due;
+    fades.idle = 1;
+  } else if (fades.nactive > 0) /* pace the next frame */
+    vsyncarm(dpy, fades.vsc);
+  be->flush(dpy);
+}
+
+
+/* milliseconds until the next fade frame (-1 if not fading) */
+static int fadetimeout (Display *dpy) {
+  if (fades.nactive == 0)
+    return -1;
+  return vsynctimeout(dpy, fades.next, fades.period);
+}
+
+
+/* run the fades until they are done */
+static void runfades (Display *dpy) {
+  while (fades.nactive > 0) {
+    double dt = fades.next - monotime();
+    if (vsync.sc) { /* wait for the vblank (or the deadline) */
+      struct pollfd pfd;
+      int timeout = fadetimeout(dpy);
+      if (timeout > 0) {
+        pfd.fd = be->fd(dpy);
+        pfd.events = POLLIN;
+        poll(&pfd, 1, timeout);
+        continue; /* (check again) */
+      }
+    } else if (dt > 0.0) {
+      struct timespec ts;
+      ts.tv_sec = (time_t)dt;
+      ts.tv_nsec = (long)((dt - (double)ts.tv_sec) * 1e9);
+      nanosleep(&ts, NULL);
+    }
+    fadestep(dpy);
+  }
+}
+
+/* }===================================================================== */
+
+
+/* set screen temp, gradually if fading */
+static void applyst (Display *dpy, int iscreen, int icrtc, tempstate ts) {
+  if (fade_ms > 0)
+    fadeto(dpy, iscreen, icrtc, ts);
+  else {
+    fadestop(iscreen); /* (would overwrite 'ts') */
+    setst(dpy, getctx(dpy, iscreen), icrtc, ts);
+  }
+}
+
+
+/* checks if temperature is in bounds and corrects it if needed */
+static long boundtemp (long temp, long dfl, const char *what) {
+  if (temp <= 0) {
+    logwarn("temperatures of 0 and below cannot be displayed (%s)", what);
+    return (dfl < 0) ? TEMP_NORM : dfl;
+  } else if (temp < MINTEMP) {
+    logwarn("temperatures below %d cannot be displayed (%s)", MINTEMP, what);
+    return (dfl < 0) ? MINTEMP : dfl;
+  }
+  return temp;
+}
+
+
+/* checks if the brightness is in bounds and corrects it if needed */
+static double boundbrightness (double brightness) {
+  if (brightness < 0.0) {
+    logwarn("brightness values below 0.0 cannot be displayed");
+    brightness = 0.0;
+  } else if (brightness > 1.0) {
+    logwarn("brightness values above 1.0 cannot be displayed");
+    brightness = 1.0;
+  }
+  return brightness;
+}
+
+
+/* checks the bounds of tempstate members and corrects them if needed */
+static void boundts (tempstate *const ts, const char *twhat) {
+  ts->temp = boundtemp(ts->temp, -1, twhat);
+  ts->brightness = boundbrightness(ts->brightness);
+}
+
+
+/* open connection to the X server */
+static Display *opendisplay (void) {
+  Display *dpy;
+  errno = 0;
+  statbegin(NULL, &statstart);
+  if (!(dpy = XOpenDisplay(NULL))) { /* connection failed? */
+    const char *msg = "could not open a connection to the X server";
+    if (fan_display) /* (say which one) */
+      logerror("%s '%s'%s%s", msg, fan_display, errno ? ": " : "",
+               errno ? strerror(errno) : "");
+    else if (errno != 0)
+      logerror("%s: %s", msg, strerror(errno));
+    else
+      logerror("%s", msg);
+    loginfo("ensure DISPLAY environment variable is set correctly");
+    exit(EXIT_FAILURE);
+  }
+  statend(NULL, &statstart, "open", -1, -1);
+  statstart.req = XNextRequest(dpy);
+  return dpy;
+}
+
+
+static void closedisplay (Display *dpy) {
+  unsigned long nreq = XNextRequest(dpy) - statstart.req;
+  statmark m;
+  freeramps();
+  freectxs(dpy);
+  freecals();
+  statbegin(dpy, &m);
+  XCloseDisplay(dpy); /* (flushes and waits for the server) */
+  statend(NULL, &m, "close", -1, -1);
+  if (stats)
+    logstat("phase=total ms=%.3f requests=%lu",
+            (monotime() - statstart.t) * 1e3, nreq);
+}
+
+
+/*
+** Select the screen and CRTC driving the output 'output_arg' among the
+** screens in [*first, *last].
+*/
+static int findoutput (Display *dpy, int *first, int *last) {
+  for (int i = *first; i <= *last; i++) {
+    outinfo *out;
+    int n = be->outputs(dpy, getctx(dpy, i), &out), c = -2;
+    for (int k = 0; k < n && c == -2; k++)
+      if (strcmp(out[k].name, output_arg) == 0)
+        c = out[k].crtc;
+    free(out);
+    if (c >= 0) { /* found? */
+      *first = *last = i;
+      crtc_arg = c;
+      return 1; /* ok */
+    } else if (c == -1) { /* output is disabled? */
+      logerror("output '%s' is not driven by any CRTC", output_arg);
+      return 0; /* fail */
+    }
+  }
+  logerror("no output named '%s'", output_arg);
+  return 0; /* fail */
+}
+
+
+static void errorargscreen (int nscreen) {
+  if (nscreen > 1) /* multiple screens? */
+    logerror("invalid screen index '%d' (expected 0..%d)", screen_arg, nscreen);
+  else /* only one screen */
+    logerror("invalid screen index '%d' (expected 0)", screen_arg);
+}
+
+
+/* 'getenv' that also sees the environment forwarded by a daemon client */
+static const char *xgetenv (const char *name) {
+  if (cmdenv) { /* running a command on behalf of a client? */
+    size_t l = strlen(name);
+    for (const char *const *e = cmdenv; *e; e++)
+      if (strncmp(*e, name, l) == 0 && (*e)[l] == '=')
+        return *e + l + 1;
+    return NULL;
+  }
+  return getenv(name);
+}
+
+
+static long envtotemp (const char *p, long dfl, const char *envn) {
+  char *endptr = NULL;
+  long x = strtol(p, &endptr, 10);
+  if (endptr == p) { /* nothing was converted? */
+    logwarn("invalid value for %s environment variable (expect integer)", envn);
+    x = dfl; /* set default value */
+  } /* else part of or the entire numeral was converted */
+  return boundtemp(x, dfl, envn);
+}
+
+
+/* logging for 'checkenv' */
+#define logenv(n, dfl) \
+  loginfo("unspecified %s environment variable (using default %ldK)", n, dfl);
+
+/*
+** Check the environment for the variables XSCT_TEMPERATURE_DAY and
+** XSCT_TEMPERATURE_NIGHT and use them as defaults (if any).
+** This also corrects then if they are out of some hard bounds.
+*/
+static void checkenv (void) {
+  const char *p;
+  if ((p = xgetenv(XSCT_TEMPERATURE_DAY)))
+    temp_day = envtotemp(p, temp_day, XSCT_TEMPERATURE_DAY);
+  else if (verbose)
+    logenv(XSCT_TEMPERATURE_DAY, temp_day);
+  if ((p = xgetenv(XSCT_TEMPERATURE_NIGHT)))
+    temp_night = envtotemp(p, temp_night, XSCT_TEMPERATURE_NIGHT);
+  else if (verbose)
+    logenv(XSCT_TEMPERATURE_NIGHT, temp_night);
+}
+
+
+/* variation in screen temperature for 'toggledaynight' */
+#if !defined(TOGGLE_DELTA)
+#define TOGGLE_DELTA        200
+#endif
+
+/* new state of a CRTC from its current state and an argument */
+typedef tempstate (*stupdate) (tempstate ts, tempstate arg);
+
+
+/*
+** Coalesced updates. A daemon keeps the new state of a delta or toggle
+** at once but uploads it at most once per frame of the fastest CRTC
+** waiting for it, so the commands of a held key add up on the kept
+** states and only the latest sum is uploaded.
+*/
+
+static struct {
+  int npending;     /* CRTCs deferred since the last upload (an upper bound) */
+  double last;      /* time of the last upload */
+  double period;    /* shortest frame period of the pending CRTCs */
+  int atomic;       /* some of them were given with '--atomic' */
+} deltas = { 0, 0.0, 0.0, 0 };
+
+
+/* keep 'ts' as the state of CRTC 'c', uploaded by 'flushdeltas' */
+static void deferst (Display *dpy, scrctx *sc, int c, tempstate ts) {
+  double hz = refreshrate(dpy, sc, &c, 1);
+  double period = 1.0 / ((hz > 0.0) ? hz : FADE_HZ);
+  keepst(sc, c, ts);
+  sc->crtc[c].pending = 1;
+  deltas.atomic |= atomic;
+  if (deltas.npending++ == 0 || period < deltas.period)
+    deltas.period = period;
+  vsyncarm(dpy, sc); /* (upload right after the next vblank) */
+}
+
+
+/* milliseconds until the pending states are due (-1 if none) */
+static int deltatimeout (Display *dpy) {
+  if (deltas.npending == 0)
+    return -1;
+  return vsynctimeout(dpy, deltas.last + deltas.period, deltas.period);
+}
+
+
+/* upload the pending states of every screen */
+static void flushdeltas (Display *dpy) {
+  int on = deltas.atomic;
+  pinramps(on);
+  for (int i = 0; on && i < ctxs.nscreen; i++) { /* (see 'prepramps') */
+    scrctx *sc = &ctxs.screens[i];
+    for (int c = 0; sc->crtc && c < sc->ncrtc; c++)
+      if (sc->crtc[c].pending)
+        prepramps(dpy, sc, c, sc->crtc[c].ts);
+  }
+  grab(dpy, on);
+  for (int i = 0; i < ctxs.nscreen; i++) {
+    scrctx *sc = &ctxs.screens[i];
+    int n = 0;
+    for (int c = 0; sc->crtc && c < sc->ncrtc; c++) {
+      if (sc->crtc[c].pending) /* (not superseded by 'keepst') */
+        n += setramps(dpy, sc, c, sc->crtc[c].ts);
+    }
+    if (n > 0)
+      be->writecache(dpy, sc);
+  }
+  ungrab(dpy, on);
+  unpinramps(on);
+  be->flush(dpy);
+  deltas.npending = 0;
+  deltas.atomic = 0;
+  deltas.last = monotime();
+  if (fades.nactive == 0) /* (fades ask for their own vblank) */
+    vsyncreset();
+}
+
+
+/*
+** Set each CRTC selected by 'icrtc' on screen 'iscreen' to 'f' of its
+** own state (see 'knownst'). If the new states are all equal they are
+** applied together (so they can fade), otherwise CRTC by CRTC at once.
+** Without fading, a daemon defers the uploads (see 'deferst'). With
+** 'prep', only prepares the uploads (see 'updatescreens').
+*/
+static void updatest (Display *dpy, int iscreen, int icrtc, stupdate f,
+                      tempstate arg, int prep) {
+  scrctx *sc = getctx(dpy, iscreen);
+  const int *ic;
+  tempstate *nts;
+  int ncrtc, i, same = 1;
+  sgamma sg;
+  if (!anyapplied(sc)) /* (probe along with the CRTC infos) */
+    getscreengamma(dpy, sc, icrtc, &sg);
+  ncrtc = selcrtcs(dpy, sc, icrtc, &ic);
+  if (ncrtc == 0)
+    return; /* nothing to update */
+  else if (!(nts = malloc(sizeof(tempstate) * (size_t)ncrtc))) {
+    logerror("cannot allocate CRTC states");
+    return;
+  }
+  i = 0;
+  while (i < ncrtc && sc->crtc[ic[i]].applied)
+    i++;
+  if (i < ncrtc) /* some state must be estimated? */
+    getscreengamma(dpy, sc, icrtc, &sg); /* (fetch the ramps at once) */
+  for (i = 0; i < ncrtc; i++) {
+    nts[i] = f(knownst(dpy, sc, ic[i]), arg);
+    if (sc->crtc[ic[i]].gammasize >= 0 && !samest(nts[i], nts[0]))
+      same = 0;
+  }
+  if (prep) {
+    for (i = 0; i < ncrtc; i++)
+      prepramps(dpy, sc, ic[i], nts[i]);
+  } else if (coalesce && fade_ms == 0) {
+    fadestop(iscreen); /* (would overwrite the new states) */
+    for (i = 0; i < ncrtc; i++)
+      deferst(dpy, sc, ic[i], nts[i]);
+  } else if (same)
+    applyst(dpy, iscreen, icrtc, nts[0]);
+  else {
+    fadestop(iscreen); /* (would overwrite the new states) */
+    for (i = 0; i < ncrtc; i++)
+      setramps(dpy, sc, ic[i], nts[i]);
+    be->writecache(dpy, sc);
+  }
+  free(nts);
+}
+
+
+/*
+** 'updatest' on the screens in [first, last]. In '--atomic' mode every
+** screen is prepared first (the states estimated and the ramps
+** generated), so one grab holds the uploads to all of them.
+*/
+static void updatescreens (Display *dpy, int first, int last, int icrtc,
+                           stupdate f, tempstate arg) {
+  int on = atomic && fade_ms == 0 && !coalesce; /* (fades grab by frame) */
+  pinramps(on);
+  for (int i = first; on && i <= last; i++)
+    updatest(dpy, i, icrtc, f, arg, 1);
+  grab(dpy, on);
+  for (int i = first; i <= last; i++)
+    updatest(dpy, i, icrtc, f, arg, 0);
+  ungrab(dpy, on);
+  unpinramps(on);
+}
+
+
+static tempstate togglest (tempstate ts, tempstate arg) {
+  (void)arg;
+  ts.temp = (ts.temp > (temp_day - TOGGLE_DELTA)) ? temp_night : temp_day;
+  return ts;
+}
+
+
+/*
+** Toggles the temperature between temp_night/temp_day for screens
+** in the interval [first, last], deciding for each CRTC on its own.
+*/
+static void toggledaynight (Display *dpy, int first, int last) {
+  tempstate none = { 0, 0.0 };
+  updatescreens(dpy, first, last, crtc_arg, togglest, none);
+}
+
+
+/*
+** Print the estimates of screens in the interval [first, last]. This
+** touches only those screens and needs no environment, so with the
+** property current it costs the resources and one round trip for the
+** CRTC infos, the property and one ramp (see 'loadcache') of each
+** screen.
+*/
+static void printestimate (Display *dpy, int first, int last) {
+  if (json)
+    fputc('[', fout);
+  for (int i = first; i <= last; i++) {
+    tempstate ts = knownst(dpy, getctx(dpy, i), crtc_arg);
+    if (json && fan_display)
+      fprintf(fout, "%s{\"display\":\"%s\",\"screen\":%d,\"temp\":%ld,"
+              "\"brightness\":%g}", (i > first) ? "," : "", fan_display, i,
+              ts.temp, ts.brightness);
+    else if (json)
+      fprintf(fout, "%s{\"screen\":%d,\"temp\":%ld,\"brightness\":%g}",
+              (i > first) ? "," : "", i, ts.temp, ts.brightness);
+    else if (fan_display)
+      fprintf(fout, "Display[%s] Screen[%d]: temp ~ %ld %g\n", fan_display, i,
+              ts.temp, ts.brightness);
+    else
+      fprintf(fout, "Screen[%d]: temp ~ %ld %g\n", i, ts.temp,
+              ts.brightness);
+  }
+  if (json)
+    fputs("]\n", fout);
+}
+
+
+static void regularsct (Display *dpy, tempstate ts, int first, int last) {
+  int on = atomic && fade_ms == 0; /* (fades grab by frame) */
+  if (ts.temp == 0) /* set default value? */
+    ts.temp = temp_day;
+  else
+    boundts(&ts, "specified by user");
+  pinramps(on);
+  for (int i = first; on && i <= last; i++) /* (see 'prepramps') */
+    prepramps(dpy, getctx(dpy, i), crtc_arg, ts);
+  grab(dpy, on);
+  for (int i = first; i <= last; i++) /* for each screen... */
+    applyst(dpy, i, crtc_arg, ts); /* set temp */
+  ungrab(dpy, on);
+  unpinramps(on);
+}
+
+
+static tempstate shiftst (tempstate ts, tempstate delta) {
+  ts.temp += delta.temp;
+  ts.brightness += delta.brightness;
+  boundts(&ts, "specified by user");
+  return ts;
+}
+
+
+static void deltasct (Display *dpy, tempstate ts, int first, int last) {
+  if (ts.temp == MIN_DELTA || ts.brightness == MIN_DELTA)
+    logerror("temperature and brightness delta must both be specified");
+  else /* shift temperature and optionally brightness of each CRTC */
+    updatescreens(dpy, first, last, crtc_arg, shiftst, ts);
+}
+
+
+/* {======================================================================
+** Batch
+** ======================================================================= */
+
+/* maximum length of a batch line */
+#define BATCH_LINE      256
+
+
+/* a single batch line: 'screen crtc temperature [brightness]' */
+typedef struct batchent {
+  int screen;       /* screen index (-1 for every screen) */
+  int crtc;         /* CRTC index (-1 for every active CRTC) */
+  tempstate ts;
+  int line;         /* line number (for error messages) */
+} batchent;
+
+
+/* parse a screen or CRTC index ('*' selects every one) */
+static int batchindex (const char *s, int *idx) {
+  char *end;
+  long l;
+  if (strcmp(s, "*") == 0) {
+    *idx = -1;
+    return 1;
+  }
+  l = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || l < 0 || l > INT_MAX)
+    return 0; /* fail */
+  *idx = (int)l;
+  return 1; /* ok */
+}
+
+
+/* parse 'line' into 'e', returns 0 if it is empty and -1 on error */
+static int parsebatch (char *line, batchent *e) {
+  char *tok[5], *p, *end, *save;
+  int n = 0;
+  if ((p = strchr(line, '#'))) /* strip comment */
+    *p = '\0';
+  for (p = strtok_r(line, " \t\r\n", &save); p && n < 5;
+       p = strtok_r(NULL, " \t\r\n", &save))
+    tok[n++] = p;
+  if (n == 0)
+    return 0; /* empty line */
+  if (n < 3 || n > 4 || !batchindex(tok[0], &e->screen) ||
+      !batchindex(tok[1], &e->crtc))
+    return -1;
+  e->ts.temp = strtol(tok[2], &end, 10);
+  if (end == tok[2] || *end != '\0')
+    return -1;
+  e->ts.brightness = 1.0;
+  if (n == 4 && ((e->ts.brightness = strtod(tok[3], &end)), end == tok[3] ||
+                 *end != '\0'))
+    return -1;
+  return 1;
+}
+
+
+/* read the lines of 'f' into '*pe', returns their number or -1 on error */
+static int readbatch (FILE *f, const char *name, batchent **pe) {
+  char line[BATCH_LINE];
+  batchent *ents = NULL;
+  int n = 0, size = 0, lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    batchent e;
+    int r;
+    lineno++;
+    if (strchr(line, '\n') == NULL && !feof(f)) {
+      logerror("%s:%d: line too long", name, lineno);
+      goto l_fail;
+    }
+    if ((r = parsebatch(line, &e)) < 0) {
+      logerror("%s:%d: invalid line (expected 'screen crtc temperature "
+               "[brightness]')", name, lineno);
+      goto l_fail;
+    } else if (r == 0) /* empty line? */
+      continue;
+    if (n == size) { /* grow array? */
+      batchent *nbe;
+      size = (size > 0) ? size * 2 : 16;
+      if (!(nbe = realloc(ents, sizeof(batchent) * (size_t)size))) {
+        logerror("cannot allocate batch");
+        goto l_fail;
+      }
+      ents = nbe;
+    }
+    e.line = lineno;
+    ents[n++] = e;
+  }
+  if (ferror(f)) {
+    logerror("cannot read %s: %s", name, strerror(errno));
+    goto l_fail;
+  }
+  *pe = ents;
+  return n;
+l_fail:
+  free(ents);
+  return -1;
+}
+
+
+/* collect the CRTCs of screen 'i' selected by any entry in 'ents' into 'ic' */
+static int batchcrtcs (Display *dpy, const batchent *ents, int n, int i,
+                       int *ic) {
+  scrctx *sc = getctx(dpy, i);
+  int ncrtc = 0;
+  fetchinfo(dpy, sc);
+  for (int c = 0; c < sc->ncrtc; c++) {
+    for (int k = 0; k < n; k++) {
+      if ((ents[k].screen == i || ents[k].screen < 0) &&
+          (ents[k].crtc == c || (ents[k].crtc < 0 && sc->crtc[c].active))) {
+        ic[ncrtc++] = c;
+        break;
+      }
+    }
+  }
+  return ncrtc;
+}
+
+
+/*
+** Set every line of the batch file 'path' (stdin if 'NULL' or "-"). The
+** resources of each screen are fetched once and the ramp sizes of all
+** selected CRTCs in one go, then the ramps are set and the property of
+** each screen is written once, all with a single flush at the end.
+** Lines are set at once (fades are per screen, so '--fade' is ignored).
+*/
+static void runbatch (Display *dpy, const char *path) {
+  int nscreen = be->nscreen(dpy);
+  const char *name = "stdin";
+  FILE *f = stdin;
+  batchent *ents;
+  char *used;
+  int *ic = NULL;
+  int n;
+  if (path && strcmp(path, "-") != 0) {
+    if (!(f = fopen(path, "r"))) {
+      logerror("cannot open '%s': %s", path, strerror(errno));
+      return;
+    }
+    name = path;
+  }
+  n = readbatch(f, name, &ents);
+  if (f != stdin)
+    fclose(f);
+  if (n <= 0)
+    return; /* error or nothing to do */
+  if (!(used = calloc((size_t)nscreen, 1))) {
+    logerror("cannot allocate batch");
+    goto l_done;
+  }
+  for (int k = 0; k < n; k++) { /* check indices and fetch resources */
+    batchent *e = &ents[k];
+    int i = (e->screen < 0) ? 0 : e->screen;
+    int last = (e->screen < 0) ? nscreen - 1 : e->screen;
+    if (e->screen >= nscreen) {
+      logerror("%s:%d: invalid screen index '%d' (expected 0..%d)", name,
+               e->line, e->screen, nscreen - 1);
+      goto l_done;
+    }
+    for (; i <= last; i++) {
+      scrctx *sc = getctx(dpy, i);
+      if (e->crtc >= sc->ncrtc) {
+        logerror("%s:%d: invalid crtc index '%d' on screen %d "
+                 "(expected 0..%d)", name, e->line, e->crtc, i,
+                 sc->ncrtc - 1);
+        goto l_done;
+      }
+      used[i] = 1;
+    }
+    if (e->ts.temp == 0) /* set default value? */
+      e->ts.temp = temp_day;
+    else
+      boundts(&e->ts, "specified by user");
+  }
+  for (int i = 0; i < nscreen; i++) { /* fetch the ramp sizes at once */
+    scrctx *sc;
+    int *nic;
+    if (!used[i])
+      continue;
+    sc = getctx(dpy, i);
+    nic = realloc(ic, sizeof(int) * (size_t)MAX(sc->ncrtc, 1));
+    if (nic == NULL) {
+      logerror("cannot allocate batch");
+      goto l_done;
+    }
+    ic = nic;
+    be->sizes(dpy, sc, ic, batchcrtcs(dpy, ents, n, i, ic));
+    fadestop(i); /* (would overwrite the batch) */
+  }
+  pinramps(atomic);
+  if (atomic) { /* prepare every line before the grab? */
+    for (int k = 0; k < n; k++) { /* (see 'prepramps') */
+      int i = (ents[k].screen < 0) ? 0 : ents[k].screen;
+      int last = (ents[k].screen < 0) ? nscreen - 1 : ents[k].screen;
+      for (; i <= last; i++)
+        prepramps(dpy, getctx(dpy, i), ents[k].crtc, ents[k].ts);
+    }
+  }
+  grab(dpy, atomic); /* (one grab for the whole batch) */
+  for (int k = 0; k < n; k++) { /* set the ramps */
+    int i = (ents[k].screen < 0) ? 0 : ents[k].screen;
+    int last = (ents[k].screen < 0) ? nscreen - 1 : ents[k].screen;
+    for (; i <= last; i++)
+      setramps(dpy, getctx(dpy, i), ents[k].crtc, ents[k].ts);
+  }
+  ungrab(dpy, atomic);
+  unpinramps(atomic);
+  for (int i = 0; i < nscreen; i++)
+    if (used[i])
+      be->writecache(dpy, getctx(dpy, i));
+  be->flush(dpy);
+l_done:
+  free(ic);
+  free(used);
+  free(ents);
+}
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Ambient light
+** ======================================================================= */
+
+/*
+** Brightness following an IIO ambient light sensor. Its illuminance is
+** read from sysfs every 'ALS_PERIOD_MS' over a descriptor kept open (one
+** 'pread' per sample, no process or X request) and smoothed on a
+** logarithmic scale, which is how the eye perceives it. The brightness
+** only changes when the smoothed level moves by more than
+** 'ALS_HYSTERESIS', and it changes through 'updatest', so a daemon
+** coalesces it with the other updates and CRTCs already at that
+** brightness are not sent anything.
+*/
+
+#if !defined(ALS_PERIOD_MS)
+#define ALS_PERIOD_MS       500
+#endif
+
+/* weight of a new sample in the smoothed level */
+#if !defined(ALS_SMOOTH)
+#define ALS_SMOOTH          0.25
+#endif
+
+/* smallest brightness change followed */
+#if !defined(ALS_HYSTERESIS)
+#define ALS_HYSTERESIS      0.05
+#endif
+
+/* brightness in the dark and illuminance (lux) of full brightness */
+#if !defined(ALS_MIN)
+#define ALS_MIN             0.3
+#endif
+
+#if !defined(ALS_LUX_MAX)
+#define ALS_LUX_MAX         1000.0
+#endif
+
+#define ALS_SYSFS   "/sys/bus/iio/devices"
+
+
+static struct {
+  int on;               /* following the sensor */
+  int fd;               /* illuminance attribute (-1 if closed) */
+  double scale, offset; /* lux = (value + offset) * scale */
+  double level;         /* smoothed log10(1 + lux) (< 0.0 before a sample) */
+  double brightness;    /* brightness last set */
+  long fade_ms;         /* duration of the changes */
+  int icrtc;            /* CRTC index (or -1) */
+  int first, last;      /* range of screens */
+  double next;          /* time of the next sample */
+} als = { .fd = -1 };
+
+
+/* read the number in the sysfs attribute 'fd' */
+static int alsnumber (int fd, double *v) {
+  char buf[64];
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  char *end;
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  *v = strtod(buf, &end);
+  return (end != buf && isfinite(*v));
+}
+
+
+/* read the attribute 'name' of device 'dir' as a number ('dfl' if none) */
+static double alsattr (const char *dir, const char *name, double dfl) {
+  char path[PATH_MAX];
+  double v = dfl;
+  int fd;
+  if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path) ||
+      (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return dfl;
+  if (!alsnumber(fd, &v))
+    v = dfl;
+  close(fd);
+  return v;
+}
+
+
+/*
+** Open the illuminance of the IIO device 'dir': the processed value in
+** lux if the driver has one, otherwise the raw one with its scale and
+** offset.
+*/
+static int alsopendev (const char *dir) {
+  static const char *const attrs[] = {
+    "in_illuminance_input", "in_illuminance0_input",
+    "in_illuminance_raw", "in_illuminance0_raw"
+  };
+  char path[PATH_MAX];
+  for (int i = 0; i < (int)(sizeof(attrs) / sizeof(attrs[0])); i++) {
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, attrs[i]) >=
+        sizeof(path) || (als.fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      continue;
+    als.scale = 1.0;
+    als.offset = 0.0;
+    if (i >= 2) { /* raw value? (scaled as given by its channel) */
+      const char *pre = (i == 2) ? "in_illuminance" : "in_illuminance0";
+      snprintf(path, sizeof(path), "%s_scale", pre);
+      als.scale = alsattr(dir, path, 1.0);
+      snprintf(path, sizeof(path), "%s_offset", pre);
+      als.offset = alsattr(dir, path, 0.0);
+    }
+    if (verbose)
+      loginfo("reading ambient light from '%s/%s'", dir, attrs[i]);
+    return 1;
+  }
+  return 0;
+}
+
+
+/* open the sensor 'dir' or, if 'NULL', the first one found */
+static int alsopen (const char *dir) {
+  DIR *d;
+  struct dirent *e;
+  int ok = 0;
+  if (dir) {
+    if (!(ok = alsopendev(dir)))
+      logerror("no illuminance in '%s'", dir);
+    return ok;
+  } else if ((d = opendir(ALS_SYSFS)) != NULL) {
+    while (!ok && (e = readdir(d)) != NULL) {
+      char path[PATH_MAX];
+      if (strncmp(e->d_name, "iio:device", 10) == 0 &&
+          (size_t)snprintf(path, sizeof(path), ALS_SYSFS "/%s",
+                           e->d_name) < sizeof(path))
+        ok = alsopendev(path);
+    }
+    closedir(d);
+  }
+  if (!ok)
+    logerror("no ambient light sensor found in '" ALS_SYSFS "'");
+  return ok;
+}
+
+
+static void alsclose (void) {
+  if (als.fd >= 0)
+    close(als.fd);
+  als.fd = -1;
+  als.on = 0;
+}
+
+
+/* brightness for the smoothed level 'level' */
+static double alsbrightness (double level) {
+  double full = log10(1.0 + ALS_LUX_MAX);
+  return ALS_MIN + (1.0 - ALS_MIN) * trimdouble(level / full, 0.0, 1.0);
+}
+
+
+/* brightness to set when none is given (the sensor's, if following one) */
+static double alslevel (void) {
+  return (als.on && als.brightness >= 0.0) ? als.brightness : 1.0;
+}
+
+
+static tempstate brightst (tempstate ts, tempstate arg) {
+  ts.brightness = arg.brightness;
+  return ts;
+}
+
+
+/* milliseconds until the next sample (-1 if not following a sensor) */
+static int alstimeout (void) {
+  double dt;
+  if (!als.on)
+    return -1;
+  dt = als.next - monotime();
+  return (dt > 0.0) ? (int)ceil(dt * 1000.0) : 0;
+}
+
+
+/*
+** Take a sample and set the brightness if the level moved far enough.
+** Screens in the middle of a fade are left alone until it is done (it
+** would stop at its target). Returns whether anything was set.
+*/
+static int alsstep (Display *dpy) {
+  tempstate arg = { 0, 0.0 };
+  long ms = fade_ms;
+  double lux, b;
+  als.next = monotime() + ALS_PERIOD_MS / 1000.0;
+  if (!alsnumber(als.fd, &lux))
+    return 0; /* (try again later) */
+  lux = MAX((lux + als.offset) * als.scale, 0.0);
+  if (als.level < 0.0) /* first sample? */
+    als.level = log10(1.0 + lux);
+  else
+    als.level += (log10(1.0 + lux) - als.level) * ALS_SMOOTH;
+  b = alsbrightness(als.level);
+  if (fabs(b - als.brightness) < ALS_HYSTERESIS)
+    return 0; /* (noise) */
+  for (int i = als.first; i <= als.last; i++)
+    if (i < fades.nscreen && fades.screens[i].sc)
+      return 0; /* fading */
+  if (verbose)
+    loginfo("ambient light %.1f lux, brightness %.2f", lux, b);
+  als.brightness = arg.brightness = b;
+  fade_ms = als.fade_ms;
+  updatescreens(dpy, als.first, als.last, als.icrtc, brightst, arg);
+  fade_ms = ms;
+  return 1;
+}
+
+
+/* follow the sensor 'dev' ('NULL' for any, "off" stops it) */
+static void alsstart (Display *dpy, const char *dev, int first, int last) {
+  alsclose();
+  if (dev && strcmp(dev, "off") == 0)
+    return;
+  else if (!alsopen(dev))
+    return;
+  als.on = 1;
+  als.level = -1.0;
+  als.brightness = -1.0; /* (set with the first sample) */
+  als.fade_ms = fade_ms;
+  als.icrtc = crtc_arg;
+  als.first = first;
+  als.last = last;
+  alsstep(dpy);
+}
+
+/* }===================================================================== */
+
+
+/* {======================================================================
+** Scheduler
+** ======================================================================= */
+
+/* duration of scheduled transitions when no fade is given */
+#if !defined(SCHEDULE_FADE_MS)
+#define SCHEDULE_FADE_MS    60000
+#endif
+
+#define DEG         (3.14159265358979323846 / 180.0)
+#define JD_UNIX     2440587.5   /* Julian date of the Unix epoch */
+#define JD_2000     2451545.0   /* Julian date of J2000.0 */
+#define DAYSECS     86400
+
+
+static struct {
+  int on;               /* scheduler is running */
+  int solar;            /* use sunrise and sunset instead of fixed times */
+  int day, night;       /* start of day and night (minutes after midnight) */
+  double lat, lon;      /* location in degrees (north and east positive) */
+  long temp_day;        /* 'temp_day' when the scheduler was started */
+  long temp_night;      /* 'temp_night' when the scheduler was started */
+  long fade_ms;         /* duration of the transitions */
+  int icrtc;            /* CRTC index (or -1) */
+  int first, last;      /* range of screens */
+  int isnight;          /* current period */
+  time_t next;          /* time of the next transition */
+  int tfd;              /* timer expiring at 'next' (-1 if none) */
+} sched = { .tfd = -1 };
+
+
+/* parse "HH:MM-HH:MM" (start of day and of night) or "LAT,LON" */
+static int parseschedule (const char *spec) {
+  int dh, dm, nh, nm, n = -1;
+  if (sscanf(spec, "%2d:%2d-%2d:%2d%n", &dh, &dm, &nh, &nm, &n) == 4 &&
+      spec[n] == '\0') {
+    if (dh > 23 || dm > 59 || nh > 23 || nm > 59 || dh < 0 || dm < 0 ||
+        nh < 0 || nm < 0 || (dh == nh && dm == nm))
+      return 0;
+    sched.solar = 0;
+    sched.day = dh * 60 + dm;
+    sched.night = nh * 60 + nm;
+    return 1;
+  } else {
+    char *end;
+    sched.lat = strtod(spec, &end);
+    if (end == spec || *end != ',')
+      return 0;
+    spec = end + 1;
+    sched.lon = strtod(spec, &end);
+    if (end == spec || *end != '\0' || fabs(sched.lat) > 90.0 ||
+        fabs(sched.lon) > 180.0)
+      return 0;
+    sched.solar = 1;
+    return 1;
+  }
+}
+
+
+/*
+** Sunrise and sunset of the solar day 'dayoff' days after the one of 't'
+** (sunrise equation). Returns 1 if the sun does not set on that day, -1
+** if it does not rise and 0 otherwise.
+*/
+static int suntimes (time_t t, int dayoff, time_t *rise, time_t *set) {
+  double n = ceil((double)t / DAYSECS + JD_UNIX - JD_2000 + 0.0008) + dayoff;
+  double j = n - sched.lon / 360.0; /* mean solar time */
+  double m = fmod(357.5291 + 0.98560028 * j, 360.0) * DEG; /* anomaly */
+  double c = 1.9148 * sin(m) + 0.02 * sin(2.0 * m) + 0.0003 * sin(3.0 * m);
+  double l = fmod(m / DEG + c + 180.0 + 102.9372, 360.0) * DEG; /* ecliptic */
+  double transit = JD_2000 + j + 0.0053 * sin(m) - 0.0069 * sin(2.0 * l);
+  double sindecl = sin(l) * sin(23.4397 * DEG);
+  double cosdecl = cos(asin(sindecl));
+  double cosw = (sin(-0.833 * DEG) - sin(sched.lat * DEG) * sindecl) /
+                (cos(sched.lat * DEG) * cosdecl);
+  double w;
+  if (cosw < -1.0)
+    return 1; /* midnight sun */
+  else if (cosw > 1.0)
+    return -1; /* polar night */
+  w = acos(cosw) / DEG / 360.0; /* half day length in days */
+  *rise = (time_t)((transit - w - JD_UNIX) * DAYSECS);
+  *set = (time_t)((transit + w - JD_UNIX) * DAYSECS);
+  return 0;
+}
+
+
+/* local time 'minutes' after midnight, 'dayoff' days after the day of 't' */
+static time_t clocktime (time_t t, int dayoff, int minutes) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  tm.tm_mday += dayoff;
+  tm.tm_hour = minutes / 60;
+  tm.tm_min = minutes % 60;
+  tm.tm_sec = 0;
+  tm.tm_isdst = -1; /* (let 'mktime' find out) */
+  return mktime(&tm);
+}
+
+
+/* find the current period and the time of the next transition */
+static void schedupdate (time_t now) {
+  time_t last = (time_t)-1;
+  int polar = 0;
+  sched.next = (time_t)-1;
+  for (int d = -1; d <= 2; d++) { /* (enough for any time zone) */
+    time_t ev[2]; /* start of day and of night */
+    if (sched.solar) {
+      int p = suntimes(now, d, &ev[0], &ev[1]);
+      if (p != 0) { /* no transition on this day? */
+        if (d == 0) polar = p;
+        continue;
+      }
+    } else {
+      ev[0] = clocktime(now, d, sched.day);
+      ev[1] = clocktime(now, d, sched.night);
+    }
+    for (int k = 0; k < 2; k++) {
+      if (ev[k] <= now && (last == (time_t)-1 || ev[k] > last)) {
+        last = ev[k];
+        sched.isnight = k;
+      } else if (ev[k] > now && (sched.next == (time_t)-1 || ev[k] < sched.next))
+        sched.next = ev[k];
+    }
+  }
+  if (polar != 0 || last == (time_t)-1) /* no recent transition? */
+    sched.isnight = (polar < 0);
+  if (sched.next == (time_t)-1) /* polar day or night? */
+    sched.next = now + DAYSECS; /* (check again tomorrow) */
+}
+
+
+/* arm 'sched.tfd' to expire at 'sched.next' */
+static void schedarm (void) {
+#if defined(__linux__)
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  if (sched.tfd < 0 &&
+      (sched.tfd = timerfd_create(CLOCK_REALTIME,
+                                  TFD_CLOEXEC | TFD_NONBLOCK)) < 0)
+    return; /* (will use the poll timeout) */
+  if (sched.on)
+    its.it_value.tv_sec = sched.next;
+  /* (wakes up early if the clock is set, as after a suspend or NTP step) */
+  if (timerfd_settime(sched.tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                      &its, NULL) < 0) {
+    close(sched.tfd);
+    sched.tfd = -1;
+  }
+#endif
+}
+
+
+/* milliseconds until the next transition (-1 if none or using a timer) */
+static int schedtimeout (void) {
+  time_t dt;
+  if (!sched.on || sched.tfd >= 0)
+    return -1;
+  dt = sched.next - time(NULL);
+  return (dt > 0) ? (int)MIN(dt, INT_MAX / 1000) * 1000 : 0;
+}
+
+
+/* set the temperature of the current period, fading if 'fade' */
+static void schedapply (Display *dpy, int fade) {
+  tempstate ts;
+  long ms = fade_ms;
+  ts.temp = sched.isnight ? sched.temp_night : sched.temp_day;
+  ts.brightness = alslevel();
+  if (verbose) {
+    char buf[32];
+    struct tm tm;
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", localtime_r(&sched.next, &tm));
+    loginfo("%s (%ldK) until %s", sched.isnight ? "night" : "day", ts.temp,
+            buf);
+  }
+  fade_ms = fade ? sched.fade_ms : 0;
+  for (int i = sched.first; i <= sched.last; i++)
+    applyst(dpy, i, sched.icrtc, ts);
+  fade_ms = ms;
+}
+
+
+/* handle an expired transition timer */
+static void schedstep (Display *dpy) {
+  time_t now = time(NULL);
+#if defined(__linux__)
+  if (sched.tfd >= 0) {
+    unsigned long long nexp;
+    if (read(sched.tfd, &nexp, sizeof(nexp)) < 0 && errno == EAGAIN)
+      return; /* (spurious wakeup) */
+  }
+#endif
+  if (now < sched.next && sched.tfd < 0)
+    return; /* not due yet */
+  else {
+    int wasnight = sched.isnight;
+    schedupdate(now); /* (also after the clock was set) */
+    if (sched.isnight != wasnight)
+      schedapply(dpy, 1);
+    schedarm();
+  }
+}
+
+
+/* start the day/night scheduler as given by 'spec' ("off" stops it) */
+static void schedstart (Display *dpy, const char *spec, int first, int last) {
+  if (strcmp(spec, "off") == 0) {
+    sched.on = 0;
+    schedarm();
+    return;
+  } else if (!parseschedule(spec)) {
+    logerror("invalid schedule '%s' (expected HH:MM-HH:MM or LAT,LON)", spec);
+    return;
+  }
+  sched.on = 1;
+  sched.temp_day = temp_day;
+  sched.temp_night = temp_night;
+  sched.fade_ms = (fade_ms > 0) ? fade_ms : SCHEDULE_FADE_MS;
+  sched.icrtc = crtc_arg;
+  sched.first = first;
+  sched.last = last;
+  schedupdate(time(NULL));
+  schedapply(dpy, 0);
+  schedarm();
+}
+
+/* }===================================================================== */
+
+
+static void processargs (Display *dpy, unsigned flags, int firstscreen,
+                         int lastscreen, tempstate ts) {
+  if (!(flags & has_e)) /* check environment variables? */
+    checkenv(); /* (this might change default values) */
+  if (flags & has_als) /* --als? (first, for the default brightness) */
+    alsstart(dpy, als_arg, firstscreen, lastscreen);
+  if (flags & has_S) { /* --schedule? */
+    schedstart(dpy, schedule_arg, firstscreen, lastscreen);
+    return;
+  }
+  if (flags & has_b) { /* --batch? */
+    runbatch(dpy, batch_arg);
+    return;
+  }
+  if (flags & has_t) /* -t or --toggle? */
+    toggledaynight(dpy, firstscreen, lastscreen);
+  if ((ts.brightness == MIN_DELTA) && !(flags & has_d))
+    ts.brightness = alslevel(); /* set default brightness */
+  if (flags & has_D) /* -D or --day */
+    ts.temp = temp_day;
   else if (flags & has_N) /* -N or --night */
     ts.temp = temp_night;
   if (flags & has_d) /* delta mode? */
     deltasct(dpy, ts, firstscreen, lastscreen);
   else if (ts.temp != MIN_DELTA) /* user provided temperature? */
     regularsct(dpy, ts, firstscreen, lastscreen);
+  else if ((flags & has_g) && !(flags & has_t)) { /* only the exponent? */
+    ts.temp = 0; /* (keep the state of each CRTC) */
+    ts.brightness = 0.0;
+    deltasct(dpy, ts, firstscreen, lastscreen);
+  }
+}
+
+
+/* run the collected arguments against an open display */
+static void run (Display *dpy, unsigned flags, tempstate ts) {
+  int nscreen = be->nscreen(dpy);
+  int firstscreen = 0;
+  int lastscreen = nscreen - 1;
+  if (screen_arg > lastscreen) /* invalid screen specified? */
+    errorargscreen(nscreen);
+  else if (screen_arg >= 0) { /* screen index was specified? */
+    firstscreen = screen_arg;
+    lastscreen = screen_arg;
+  }
+  if (output_arg && !findoutput(dpy, &firstscreen, &lastscreen))
+    return; /* no such output */
+  if (!(flags & ~(has_s | has_c | has_o | has_display)) &&
+      ts.temp == MIN_DELTA) /* only a selection? */
+    printestimate(dpy, firstscreen, lastscreen);
+  else
+    processargs(dpy, flags, firstscreen, lastscreen, ts);
+}
+
+
+/* run the collected arguments on the DRM device 'drm_arg' */
+static void rundrm (unsigned flags, tempstate ts) {
+#if defined(XSCT_DRM)
+  if (flags & (has_daemon | has_w | has_S | has_als | has_display)) {
+    logerror("--drm cannot be used with --daemon, --watch, --schedule, "
+             "--als or --display");
+    return;
+  } else if (!drmopen(drm_arg))
+    return;
+  be = &drmbackend;
+  statbegin(NULL, &statstart);
+  run(NULL, flags & ~has_drm, ts);
+  runfades(NULL);
+  freeramps();
+  freectxs(NULL);
+  freecals();
+  drmclose();
+  statend(NULL, &statstart, "total", -1, -1);
+#else
+  (void)flags; (void)ts; /* unused */
+  logerror("--drm is not supported (xsct was built without XSCT_DRM)");
+#endif
+}
+
+
+/* {======================================================================
+** Daemon
+** ======================================================================= */
+
+/* limits of a single client request */
+#define DAEMON_MAXREQ       4096
+#define DAEMON_MAXARGS      64
+
+/* timeout (in seconds) for reading a request and writing the reply */
+#define DAEMON_TIMEOUT      1
+
+static volatile sig_atomic_t quit = 0; /* set by termination signals */
+
+
+/*
+** Get the private fallback of 'XDG_RUNTIME_DIR' into 'buf', creating
+** it if needed. Anyone can create names in '/tmp', so the directory is
+** refused unless it is ours and closed to everyone else.
+*/
+static int tmpruntimedir (char *buf, size_t size) {
+  struct stat st;
+  int n = snprintf(buf, size, "/tmp/xsct-%ld", (long)getuid());
+  if (n <= 0 || (size_t)n >= size)
+    return 0;
+  if (mkdir(buf, 0700) < 0 && errno != EEXIST) {
+    logwarn("cannot create '%s': %s", buf, strerror(errno));
+    return 0;
+  } else if (lstat(buf, &st) < 0 || !S_ISDIR(st.st_mode) ||
+             st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    logwarn("'%s' is not a private directory of this user", buf);
+    return 0;
+  }
+  return 1; /* ok */
+}
+
+
+/* get the path of the daemon file 'xsct-DISPLAY.ext' into 'buf' */
+static int runtimepath (char *buf, size_t size, const char *ext) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  const char *dname = XDisplayName(NULL);
+  char name[64], tmp[64];
+  size_t i;
+  int n;
+  for (i = 0; dname[i] && i < sizeof(name) - 1; i++) { /* sanitize name */
+    unsigned char c = (unsigned char)dname[i];
+    name[i] = (isalnum(c) || c == '.' || c == ':' || c == '-') ? c : '_';
+  }
+  name[i] = '\0';
+  if (!dir || !*dir) { /* no runtime directory? */
+    if (!tmpruntimedir(tmp, sizeof(tmp)))
+      return 0;
+    dir = tmp;
+  }
+  n = snprintf(buf, size, "%s/xsct-%s.%s", dir, name, ext);
+  return (n > 0 && (size_t)n < size);
+}
+
+
+/* get the path of the daemon socket for the current display */
+static int socketpath (struct sockaddr_un *sa) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  return runtimepath(sa->sun_path, sizeof(sa->sun_path), "sock");
+}
+
+
+/*
+** Status segment. The daemon publishes the state of every CRTC in the
+** file 'xsct-DISPLAY.status' next to its socket, so status widgets can
+** map it and read a state with plain loads instead of asking the daemon
+** or the X server. It is a seqlock: 'seq' is odd while the entries are
+** written, so a reader copies an entry between two equal even values of
+** 'seq' (see xsct(1) for the layout).
+*/
+
+#define STATUS_MAGIC      0x54435358UL  /* "XSCT" */
+#define STATUS_VERSION    2
+#define STATUS_MAX        64  /* entries */
+
+typedef struct statusent {
+  int32_t screen;
+  int32_t crtc;         /* index of the CRTC on its screen */
+  int32_t active;       /* CRTC has a mode and some output */
+  int32_t temp;         /* (0 if unknown) */
+  int32_t verified;     /* state set by the daemon (else last known) */
+  int32_t reserved;
+  double brightness;
+} statusent;
+
+typedef struct statusseg {
+  uint32_t magic;           /* 'STATUS_MAGIC' */
+  uint32_t version;         /* 'STATUS_VERSION' */
+  volatile uint32_t seq;    /* odd while the entries are written */
+  uint32_t nent;            /* number of valid entries */
+  statusent ent[STATUS_MAX];
+} statusseg;
+
+/* full barrier, orders the entries against 'seq' */
+#define statusfence()     __sync_synchronize()
+
+
+static struct {
+  statusseg *seg;   /* mapped segment ('NULL' if none) */
+  char path[256];
+} status = { NULL, "" };
+
+
+/*
+** Create and map the status segment (the daemon works without it). The
+** daemon holds the socket, so a segment already there is stale and is
+** replaced by a new file, never opened (it might be a link planted by
+** someone else).
+*/
+static void statusopen (void) {
+  mode_t mask = umask(077); /* segment is private to the user */
+  void *p = MAP_FAILED;
+  int fd = -1;
+  if (!runtimepath(status.path, sizeof(status.path), "status"))
+    errno = ENAMETOOLONG;
+  else if ((unlink(status.path) == 0 || errno == ENOENT) &&
+           (fd = open(status.path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW |
+                      O_CLOEXEC, 0600)) >= 0 &&
+           ftruncate(fd, sizeof(statusseg)) == 0)
+    p = mmap(NULL, sizeof(statusseg), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+  umask(mask);
+  if (p == MAP_FAILED) {
+    logwarn("cannot create status segment '%s': %s", status.path,
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(status.path);
+    }
+    return;
+  }
+  close(fd);
+  status.seg = p; /* (zeroed, so 'seq' is even and there are no entries) */
+  status.seg->magic = STATUS_MAGIC;
+  status.seg->version = STATUS_VERSION;
+}
+
+
+static void statusclose (void) {
+  if (status.seg) {
+    munmap(status.seg, sizeof(statusseg));
+    unlink(status.path);
+    status.seg = NULL;
+  }
+}
+
+
+/*
+** Publish the state of every CRTC: the state last set on it or else the
+** last known one, recorded in 'XSCT_PROPERTY' or estimated from the end
+** points at hand. No ramp is read for it, so such entries are marked as
+** not verified; after a change by another program only the property is
+** read again (see 'propchanged').
+*/
+static void statuspublish (Display *dpy) {
+  static statusent ent[STATUS_MAX];
+  statusseg *seg = status.seg;
+  uint32_t n = 0;
+  if (seg == NULL)
+    return;
+  for (int i = 0; i < be->nscreen(dpy); i++) {
+    scrctx *sc = getctx(dpy, i);
+    fetchinfo(dpy, sc);
+    calibrate(dpy, sc);
+    if (!sc->propread)
+      be->readcache(dpy, sc);
+    for (int c = 0; c < sc->ncrtc && n < STATUS_MAX; c++, n++) {
+      const crtcstate *cs = &sc->crtc[c];
+      tempstate ts = { 0, 0.0 };
+      if (cs->applied)
+        ts = cs->ts;
+      else if (cs->active && hasst(cs))
+        ts = cs->st;
+      else if (cs->active) {
+        sgamma sg = { 0 };
+        int known = crtcgamma(cs, &sg);
+        ts = gammatemp(sg, known); /* (0 if unknown) */
+      }
+      ent[n].screen = i;
+      ent[n].crtc = c;
+      ent[n].active = cs->active;
+      ent[n].temp = (int32_t)ts.temp;
+      ent[n].verified = cs->applied;
+      ent[n].reserved = 0;
+      ent[n].brightness = ts.brightness;
+    }
+  }
+  seg->seq++; /* odd (writing) */
+  statusfence();
+  memcpy(seg->ent, ent, sizeof(statusent) * n);
+  seg->nent = n;
+  statusfence();
+  seg->seq++; /* even (stable) */
+}
+
+
+static int writeall (int fd, const char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return 0; /* fail */
+    }
+    buf += w;
+    n -= (size_t)w;
+  }
+  return 1; /* ok */
+}
+
+
+/* read until EOF or until 'n' bytes are read */
+static ssize_t readall (int fd, char *buf, size_t n) {
+  size_t nr = 0;
+  while (nr < n) {
+    ssize_t r = read(fd, buf + nr, n - nr);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1; /* fail */
+    } else if (r == 0) /* EOF? */
+      break; /* done */
+    nr += (size_t)r;
+  }
+  return (ssize_t)nr;
+}
+
+
+/*
+** Forward the command line to a running daemon.
+** Request is a list of NUL-terminated strings: the XSCT_* environment
+** variables terminated by an empty string, followed by 'argv'.
+** Reply is a "<status> <stdout length>\n" header followed by the
+** output for stdout and then the output for stderr.
+** Returns 0 if there is no daemon running.
+*/
+static int forwardargs (int argc, const char *const *argv) {
+  static const char *const envs[] = {
+    XSCT_TEMPERATURE_DAY, XSCT_TEMPERATURE_NIGHT, NULL
+  };
+  struct sockaddr_un sa;
+  unsigned long outlen;
+  char *req = NULL;
+  size_t reqlen = 0;
+  int fd, status, ok;
+  FILE *f;
+  if (!socketpath(&sa) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return 0;
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return 0; /* no daemon */
+  }
+  if (!(f = open_memstream(&req, &reqlen))) {
+    close(fd);
+    return 0; /* run the command ourselves */
+  }
+  for (const char *const *e = envs; *e; e++) {
+    const char *v = getenv(*e);
+    if (v) {
+      fprintf(f, "%s=%s", *e, v);
+      fputc('\0', f);
+    }
+  }
+  fputc('\0', f); /* end of environment */
+  for (int i = 0; i < argc; i++) {
+    fputs(argv[i], f);
+    fputc('\0', f);
+  }
+  fclose(f);
+  ok = writeall(fd, req, reqlen);
+  free(req);
+  shutdown(fd, SHUT_WR);
+  if (ok && (f = fdopen(fd, "r"))) {
+    ok = (fscanf(f, "%d %lu", &status, &outlen) == 2 && fgetc(f) == '\n');
+    if (ok) {
+      int c;
+      for (; outlen > 0 && (c = fgetc(f)) != EOF; outlen--)
+        fputc(c, stdout);
+      while ((c = fgetc(f)) != EOF)
+        fputc(c, stderr);
+      fail = status;
+    }
+    fclose(f); /* (also closes 'fd') */
+  } else
+    close(fd);
+  if (!ok)
+    logerror("invalid reply from the daemon at '%s'", sa.sun_path);
+  return 1;
+}
+
+
+/* run a client command line with fresh per-command state */
+static void runcmd (Display *dpy, int argc, const char *const *argv) {
+  tempstate ts = { .temp = MIN_DELTA, .brightness = MIN_DELTA };
+  const char *dprogname = progname, *dfan = fan_display;
+  int dverbose = verbose, dstats = stats;
+  unsigned flags;
+  statmark m;
+  fail = 0;
+  crtc_arg = screen_arg = -1;
+  output_arg = display_arg = als_arg = NULL;
+  verbose = stats = atomic = json = force = 0;
+  fade_ms = 0;
+  gamma_arg = 0.0;
+  ease = EASE_SMOOTH;
+  temp_day = TEMP_NORM;
+  temp_night = TEMP_NIGHT;
+  flags = collectargs(argc, argv, &ts);
+  /* (the client sent this to the daemon of each display in its list) */
+  fan_display = (display_arg && strchr(display_arg, ',')) ?
+                XDisplayString(dpy) : NULL;
+  statbegin(dpy, &statstart);
+  if (flags & has_h)
+    usage();
+  else if (flags & has_daemon)
+    logerror("daemon is already running");
+  else if (!fail) /* (the daemon is always watching) */
+    run(dpy, flags & ~has_w, ts);
+  statbegin(dpy, &m);
+  XSync(dpy, False); /* (report X errors to this client) */
+  statend(dpy, &m, "sync", -1, -1);
+  statend(dpy, &statstart, "total", -1, -1);
+  progname = dprogname;
+  fan_display = dfan;
+  verbose = dverbose;
+  stats = dstats;
+}
+
+
+/* serve a single client request (see 'forwardargs') */
+static void servecmd (Display *dpy, int cfd) {
+  static char req[DAEMON_MAXREQ];
+  const char *env[DAEMON_MAXARGS + 1];
+  const char *argv[DAEMON_MAXARGS + 1];
+  struct timeval tv = { DAEMON_TIMEOUT, 0 };
+  char *out = NULL, *err = NULL;
+  size_t outlen = 0, errlen = 0;
+  int nenv = 0, argc = 0;
+  char *p, *end;
+  ssize_t n;
+  setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if ((n = readall(cfd, req, sizeof(req))) == 0)
+    return; /* connection probe (see 'listensocket') */
+  else if (n < 0 || (size_t)n == sizeof(req) || req[n - 1] != '\0')
+    goto l_invalid;
+  end = req + n;
+  for (p = req; p < end && *p && nenv < DAEMON_MAXARGS; p += strlen(p) + 1)
+    env[nenv++] = p;
+  if (p >= end || *p++ != '\0') /* missing end of environment? */
+    goto l_invalid;
+  for (; p < end && argc < DAEMON_MAXARGS; p += strlen(p) + 1)
+    argv[argc++] = p;
+  if (p < end || argc == 0) /* too many arguments or no 'argv[0]'? */
+    goto l_invalid;
+  env[nenv] = argv[argc] = NULL;
+  fout = open_memstream(&out, &outlen);
+  ferr = open_memstream(&err, &errlen);
+  if (fout && ferr) {
+    char hdr[64];
+    int hl;
+    cmdenv = env;
+    runcmd(dpy, argc, argv);
+    cmdenv = NULL;
+    fflush(fout);
+    fflush(ferr);
+    hl = snprintf(hdr, sizeof(hdr), "%d %lu\n", fail, (unsigned long)outlen);
+    if (writeall(cfd, hdr, (size_t)hl) && writeall(cfd, out, outlen))
+      writeall(cfd, err, errlen);
+  }
+  if (fout) fclose(fout);
+  if (ferr) fclose(ferr);
+  free(out);
+  free(err);
+  fout = stdout;
+  ferr = stderr;
+  fail = 0; /* (client errors are not daemon errors) */
+  return;
+l_invalid:
+  logwarn("ignoring invalid client request");
+}
+
+
+/* bind the daemon socket, replacing a stale one */
+static int listensocket (struct sockaddr_un *sa) {
+  mode_t mask = umask(077); /* socket is private to the user */
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int ok = (fd >= 0);
+  if (ok && bind(fd, (struct sockaddr *)sa, sizeof(*sa)) < 0) {
+    ok = 0;
+    if (errno == EADDRINUSE) { /* daemon running or stale socket? */
+      int cfd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (cfd >= 0 && connect(cfd, (struct sockaddr *)sa, sizeof(*sa)) == 0)
+        errno = EADDRINUSE; /* another daemon is serving this display */
+      else if (unlink(sa->sun_path) == 0)
+        ok = (bind(fd, (struct sockaddr *)sa, sizeof(*sa)) == 0);
+      if (cfd >= 0) close(cfd);
+    }
+  }
+  umask(mask);
+  if (ok && listen(fd, SOMAXCONN) == 0)
+    return fd;
+  logerror("cannot listen on '%s': %s", sa->sun_path, strerror(errno));
+  if (fd >= 0) close(fd);
+  return -1;
+}
+
+
+/* X errors must not terminate the daemon */
+static int onxerror (Display *dpy, XErrorEvent *ev) {
+  char msg[128];
+  XGetErrorText(dpy, ev->error_code, msg, sizeof(msg));
+  logerror("X error: %s (request %d.%d)", msg, ev->request_code,
+           ev->minor_code);
+  return 0;
+}
+
+
+static void onsignal (int sig) {
+  (void)sig; /* unused */
+  quit = 1;
+}
+
+
+/* index of the screen context with root window 'root' (-1 if none) */
+static int rootctx (Display *dpy, Window root) {
+  for (int i = 0; i < ctxs.nscreen; i++)
+    if (ctxs.screens[i].crtc && RootWindow(dpy, i) == root)
+      return i;
+  return -1;
+}
+
+
+/* set the last state of CRTC 'c' again (see 'keepst') */
+static void reapply (Display *dpy, int iscreen, int c) {
+  scrctx *sc = &ctxs.screens[iscreen];
+  if (sc->crtc[c].applied) {
+    if (verbose)
+      loginfo("reapplying %ldK to CRTC %d of screen %d", sc->crtc[c].ts.temp,
+              c, iscreen);
+    sc->crtc[c].known = 0; /* (the server might have reset its ramp) */
+    setst(dpy, sc, c, sc->crtc[c].ts);
+  }
+}
+
+
+/* a CRTC was enabled, disabled or changed its mode */
+static void crtcchanged (Display *dpy, const XRRCrtcChangeNotifyEvent *ev) {
+  int i = rootctx(dpy, ev->window);
+  scrctx *sc;
+  int c = 0;
+  if (i < 0)
+    return; /* screen not used yet */
+  sc = &ctxs.screens[i];
+  while (c < sc->xrr_res->ncrtc && sc->xrr_res->crtcs[c] != ev->crtc)
+    c++;
+  if (c == sc->xrr_res->ncrtc) { /* new CRTC? */
+    fadestop(i);
+    refreshctx(dpy, i);
+    return; /* (its state is unknown) */
+  }
+  fetchinfo(dpy, sc);
+  sc->crtc[c].mode = ev->mode;
+  sc->crtc[c].active = (ev->mode != None);
+  sc->crtc[c].known = 0; /* (the CRTC might have the default ramp now) */
+  sc->nlive = 0; /* rebuild live list */
+  for (int k = 0; k < sc->xrr_res->ncrtc; k++)
+    if (sc->crtc[k].active)
+      sc->live[sc->nlive++] = k;
+  if (sc->crtc[c].active)
+    reapply(dpy, i, c);
+}
+
+
+/*
+** 'XSCT_PROPERTY' of a screen changed. Unless it is the echo of an own
+** write, another process set ramps (e.g. a '--batch' run beside the
+** daemon): the states the daemon applied there are no longer its to
+** keep, and the ramps and the property are read again when next needed.
+*/
+static int propchanged (Display *dpy, const XPropertyEvent *ev) {
+  int i = rootctx(dpy, ev->window);
+  scrctx *sc;
+  if (i < 0 || ev->atom == None || ev->atom != gammaatom(dpy))
+    return 0; /* screen not used yet or some other property */
+  sc = &ctxs.screens[i];
+  if (sc->propwrites > 0) { /* (requests and events keep their order) */
+    sc->propwrites--;
+    return 0;
+  }
+  if (verbose)
+    loginfo("screen %d was set by another process", i);
+  fadestop(i);
+  if (sc->proppending) /* (reply might predate the change) */
+    readprop(dpy, sc);
+  for (int c = 0; c < sc->ncrtc; c++) {
+    crtcstate *cs = &sc->crtc[c];
+    cs->applied = 0;
+    cs->known = 0;
+    cs->sthash = 0;
+  }
+  sc->propread = 0;
+  return 1;
+}
+
+
+/*
+** Keep the screen contexts up to date with the RandR configuration and
+** 'XSCT_PROPERTY'. Returns whether states might have changed.
+*/
+static int handleevent (Display *dpy, XEvent *ev, int evbase) {
+  if (ev->type == PropertyNotify)
+    return propchanged(dpy, &ev->xproperty);
+  else if (ev->type == evbase + RRScreenChangeNotify) {
+    int i = rootctx(dpy, ((XRRScreenChangeNotifyEvent *)ev)->root);
+    XRRUpdateConfiguration(ev);
+    if (i >= 0) {
+      int fading = (i < fades.nscreen && fades.screens[i].sc);
+      fadestop(i); /* (ramps might not match the new CRTCs) */
+      refreshctx(dpy, i);
+      if (fading) { /* jump to the end of the fade */
+        for (int c = 0; c < ctxs.screens[i].xrr_res->ncrtc; c++)
+          reapply(dpy, i, c);
+      }
+    }
+  } else if (ev->type == evbase + RRNotify &&
+             ((XRRNotifyEvent *)ev)->subtype == RRNotify_CrtcChange)
+    crtcchanged(dpy, (XRRCrtcChangeNotifyEvent *)ev);
+  else
+    return 0;
+  return 1;
+}
+
+
+/*
+** Block until terminated, serving the clients of the daemon socket 'lfd'
+** (if not -1), uploading fade frames, running the scheduler, following
+** the light sensor and reapplying the last state to CRTCs that are
+** enabled or reconfigured.
+*/
+static void serve (Display *dpy, int lfd) {
+  struct sigaction act;
+  int evbase, errbase;
+  int changed = 0; /* states might have changed (see 'statuspublish') */
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = onsignal;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  act.sa_handler = SIG_IGN; /* clients may disconnect early */
+  sigaction(SIGPIPE, &act, NULL);
+  XSetErrorHandler(onxerror);
+  if (XRRQueryExtension(dpy, &evbase, &errbase)) { /* keep contexts fresh */
+    for (int i = 0; i < XScreenCount(dpy); i++)
+      XRRSelectInput(dpy, RootWindow(dpy, i),
+                     RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+  } else
+    evbase = -1;
+  gammaatom(dpy); /* (see 'propchanged') */
+  for (int i = 0; i < XScreenCount(dpy); i++)
+    XSelectInput(dpy, RootWindow(dpy, i), PropertyChangeMask);
+  for (int i = 0; i < ctxs.nscreen; i++)
+    ctxs.screens[i].propwrites = 0; /* (earlier writes have no events) */
+  while (!quit) {
+    struct pollfd pfd[3];
+    int timeout = fadetimeout(dpy);
+    int stimeout = schedtimeout();
+    int dtimeout = deltatimeout(dpy);
+    int atimeout = alstimeout();
+    int vb;
+    while (XPending(dpy)) { /* drain the event queue */
+      XEvent ev;
+      XNextEvent(dpy, &ev);
+      if (handleevent(dpy, &ev, evbase))
+        changed = 1;
+    }
+    XFlush(dpy); /* (reapplied ramps) */
+    pfd[0].fd = lfd; /* (ignored if negative) */
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ConnectionNumber(dpy);
+    pfd[1].events = POLLIN;
+    pfd[2].fd = sched.on ? sched.tfd : -1;
+    pfd[2].events = POLLIN;
+    if (timeout < 0 || (stimeout >= 0 && stimeout < timeout))
+      timeout = stimeout;
+    if (timeout < 0 || (dtimeout >= 0 && dtimeout < timeout))
+      timeout = dtimeout;
+    if (timeout < 0 || (atimeout >= 0 && atimeout < timeout))
+      timeout = atimeout;
+    if (poll(pfd, 3, timeout) < 0) {
+      if (errno == EINTR) continue;
+      logerror("poll: %s", strerror(errno));
+      break;
+    }
+    if ((vb = vsynced(dpy))) /* (for the fades and deltas below) */
+      vsyncreset();
+    if (fades.nactive > 0 && (vb || fadetimeout(dpy) == 0)) /* next frame? */
+      fadestep(dpy);
+    if (sched.on && ((pfd[2].revents & POLLIN) || schedtimeout() == 0)) {
+      schedstep(dpy); /* next transition */
+      changed = 1;
+    }
+    if (als.on && alstimeout() == 0 && alsstep(dpy)) /* next sample */
+      changed = 1;
+    if (pfd[0].revents & POLLIN) { /* have client? */
+      int cfd = accept(lfd, NULL, NULL);
+      if (cfd >= 0) {
+        servecmd(dpy, cfd);
+        close(cfd);
+        changed = 1;
+      }
+    }
+    if (deltas.npending > 0 && (vb || deltatimeout(dpy) == 0)) /* due? */
+      flushdeltas(dpy);
+    if (changed) {
+      statuspublish(dpy);
+      changed = 0;
+    }
+  }
+  if (deltas.npending > 0) /* (do not lose the last commands) */
+    flushdeltas(dpy);
+}
+
+
+/* serve commands over the daemon socket until terminated */
+static void rundaemon (Display *dpy) {
+  struct sockaddr_un sa;
+  int lfd;
+  if (!socketpath(&sa)) {
+    logerror("no usable daemon socket path");
+    return;
+  } else if ((lfd = listensocket(&sa)) < 0)
+    return;
+  if (verbose)
+    loginfo("serving display '%s' on '%s'", XDisplayString(dpy), sa.sun_path);
+  statusopen();
+  for (int i = 0; status.seg && i < be->nscreen(dpy); i++)
+    getst(dpy, getctx(dpy, i), -1); /* (end points for 'statuspublish') */
+  statuspublish(dpy);
+  coalesce = 1;
+  serve(dpy, lfd);
+  statusclose();
+  close(lfd);
+  unlink(sa.sun_path);
+}
+
+
+/* keep the current state on the CRTCs until terminated */
+static void runwatch (Display *dpy) {
+  for (int i = 0; i < XScreenCount(dpy); i++) {
+    scrctx *sc = getctx(dpy, i);
+    int c = 0;
+    while (c < sc->xrr_res->ncrtc && !sc->crtc[c].applied)
+      c++;
+    if (c == sc->xrr_res->ncrtc) { /* nothing set? (keep the estimate) */
+      tempstate ts = getst(dpy, sc, -1);
+      if (ts.temp >= MINTEMP)
+        keepst(sc, -1, ts);
+    }
+  }
+  if (verbose)
+    loginfo("watching display '%s'", XDisplayString(dpy));
+  serve(dpy, -1);
+}
+
+/* }===================================================================== */
+
+
+/* option 'f' is given as "off" (which only stops it in a daemon) */
+#define isoff(flags, f, arg) \
+        (((flags) & (f)) && (arg) && strcmp((arg), "off") == 0)
+
+
+/* run the collected arguments on display 'DISPLAY' (or its daemon) */
+static void runx (int argc, const char *const *argv, unsigned flags,
+                  tempstate ts) {
+  if (flags & has_daemon) { /* daemon mode? */
+    Display *dpy = opendisplay();
+    flags &= ~(has_daemon | has_w); /* (the daemon is always watching) */
+    if (flags || ts.temp != MIN_DELTA) /* have initial command? */
+      run(dpy, flags, ts);
+    rundaemon(dpy);
+    closedisplay(dpy);
+  } else if ((flags & has_b) || /* (batch input is read by this process) */
+             !forwardargs(argc, argv)) { /* no daemon running? */
+    Display *dpy;
+    if (isoff(flags, has_S, schedule_arg) || isoff(flags, has_als, als_arg)) {
+      logerror("--%s off needs a running daemon", /* (nothing to watch) */
+               isoff(flags, has_S, schedule_arg) ? "schedule" : "als");
+      return;
+    }
+    dpy = opendisplay();
+    if (flags & (has_w | has_S | has_als)) { /* watch mode? */
+      flags &= ~has_w;
+      if (flags || ts.temp != MIN_DELTA) /* have initial command? */
+        run(dpy, flags, ts);
+      if (!fail)
+        runwatch(dpy);
+    } else {
+      run(dpy, flags, ts);
+      runfades(dpy);
+    }
+    closedisplay(dpy);
+  }
+}
+
+
+/* longest display name in a '--display' list */
+#define DISPLAY_NAME_MAX    256
+
+
+/* output of a child of 'fanout' */
+typedef struct fanchild {
+  int fd;         /* read end of its pipe (-1 once at its end) */
+  FILE *f;        /* collects 'out' */
+  char *out;
+  size_t len;
+} fanchild;
+
+
+/*
+** Read from the pipes of the 'n' children in 'ch' until each of them is
+** at its end. All of them are read at once, so no child blocks on a full
+** pipe while another one is being read.
+*/
+static void fanread (fanchild *ch, int n) {
+  struct pollfd *pfd = malloc(sizeof(struct pollfd) * (size_t)MAX(n, 1));
+  int nopen = 0;
+  for (int k = 0; k < n; k++)
+    nopen += (ch[k].fd >= 0);
+  while (pfd && nopen > 0) {
+    for (int k = 0; k < n; k++) {
+      pfd[k].fd = ch[k].fd; /* (ignored if negative) */
+      pfd[k].events = POLLIN;
+    }
+    if (poll(pfd, (nfds_t)n, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      logerror("cannot read the output of displays: %s", strerror(errno));
+      break;
+    }
+    for (int k = 0; k < n; k++) {
+      char buf[4096];
+      ssize_t r;
+      if (ch[k].fd < 0 || !(pfd[k].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if ((r = read(ch[k].fd, buf, sizeof(buf))) > 0) {
+        if (ch[k].f)
+          fwrite(buf, 1, (size_t)r, ch[k].f);
+      } else if (r == 0 || errno != EINTR) { /* at its end? */
+        close(ch[k].fd);
+        ch[k].fd = -1;
+        nopen--;
+      }
+    }
+  }
+  for (int k = 0; k < n; k++) /* (on errors) */
+    if (ch[k].fd >= 0)
+      close(ch[k].fd);
+  free(pfd);
+}
+
+
+/*
+** Print the outputs of the children in 'ch' in display order. With
+** '--json' each child printed one array, so their elements are printed
+** as one array instead.
+*/
+static void fanprint (fanchild *ch, int n) {
+  int narr = 0, nel = 0; /* arrays and elements printed */
+  for (int k = 0; k < n; k++) {
+    const char *b, *e;
+    if (ch[k].f == NULL || fclose(ch[k].f) != 0 || ch[k].out == NULL)
+      continue;
+    if (!json) {
+      fwrite(ch[k].out, 1, ch[k].len, fout);
+      continue;
+    }
+    b = memchr(ch[k].out, '[', ch[k].len);
+    e = ch[k].out + ch[k].len;
+    while (e > ch[k].out && e[-1] != ']')
+      e--;
+    if (b == NULL || e <= b + 1) /* no array? (the child failed) */
+      continue;
+    if (narr++ == 0)
+      fputc('[', fout);
+    if (e - b > 2) /* any element? */
+      fprintf(fout, "%s%.*s", (nel++ > 0) ? "," : "", (int)(e - b - 2), b + 1);
+  }
+  if (narr > 0)
+    fputs("]\n", fout);
+  for (int k = 0; k < n; k++)
+    free(ch[k].out);
+}
+
+
+/*
+** Run on each display of the comma-separated 'list' at the same time.
+** All of the state of xsct is per process, so each display gets a child
+** of its own (as if started with that 'DISPLAY'); the total time is the
+** time of the slowest display instead of the sum. The children print
+** into pipes and the parent prints what they printed in display order
+** (see 'fanprint').
+*/
+static void fanout (const char *list, int argc, const char *const *argv,
+                    unsigned flags, tempstate ts) {
+  int nchild = 0, maxchild = 1, status;
+  fanchild *ch;
+  if (!strchr(list, ',')) { /* single display? */
+    setenv("DISPLAY", list, 1);
+    runx(argc, argv, flags, ts);
+    return;
+  }
+  for (const char *l = list; *l; l++)
+    maxchild += (*l == ',');
+  if ((ch = calloc((size_t)maxchild, sizeof(fanchild))) == NULL) {
+    logerror("cannot allocate %d displays", maxchild);
+    return;
+  }
+  fflush(NULL); /* (would be written again by every child) */
+  while (*list) {
+    char name[DISPLAY_NAME_MAX];
+    size_t n = strcspn(list, ",");
+    int pfd[2];
+    pid_t pid;
+    if (n >= sizeof(name)) {
+      logerror("display name '%.16s...' is too long", list);
+      break;
+    }
+    memcpy(name, list, n);
+    name[n] = '\0';
+    list += n + (list[n] == ','); /* skip name and comma */
+    if (n == 0) /* (empty name) */
+      continue;
+    else if (pipe(pfd) < 0) {
+      logerror("cannot create a pipe for display '%s': %s", name,
+               strerror(errno));
+      break;
+    } else if ((pid = fork()) < 0) {
+      logerror("cannot fork for display '%s': %s", name, strerror(errno));
+      close(pfd[0]);
+      close(pfd[1]);
+      break;
+    } else if (pid == 0) { /* child? */
+      close(pfd[0]);
+      if (dup2(pfd[1], STDOUT_FILENO) < 0)
+        exit(EXIT_FAILURE);
+      close(pfd[1]);
+      for (int k = 0; k < nchild; k++) /* (pipes of the other children) */
+        close(ch[k].fd);
+      fan_display = name;
+      setenv("DISPLAY", name, 1);
+      runx(argc, argv, flags, ts);
+      fflush(fout);
+      exit((fail) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    close(pfd[1]);
+    ch[nchild].fd = pfd[0];
+    ch[nchild].f = open_memstream(&ch[nchild].out, &ch[nchild].len);
+    nchild++;
+  }
+  fanread(ch, nchild); /* (until every child closed its output) */
+  for (int k = nchild; k > 0; ) { /* wait for every display */
+    if (wait(&status) < 0) {
+      if (errno == EINTR)
+        continue;
+      logerror("cannot wait for displays: %s", strerror(errno));
+      break;
+    }
+    k--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      fail = 1; /* (the child has logged why) */
+  }
+  fanprint(ch, nchild);
+  free(ch);
 }
 
 
 int main (int argc, const char *const *argv) {
   tempstate ts = { .temp = MIN_DELTA, .brightness = MIN_DELTA };
-  unsigned flags = collectargs(argc, argv, &ts);
+  unsigned flags;
+  fout = stdout;
+  ferr = stderr;
+  flags = collectargs(argc, argv, &ts);
   if (flags & has_h) /* have -h or --help ? */
     usage(); /* print usage and done */
+  else if (!fail && (flags & has_cal)) /* (needs no display) */
+    importcal(cal_arg, output_arg);
+  else if (!fail && (flags & has_drm)) /* no X server? */
+    rundrm(flags, ts);
   else if (!fail) { /* no errors while collecting arguments? */
-    Display *dpy = opendisplay();
-    int nscreen = XScreenCount(dpy);
-    int firstscreen = 0;
-    int lastscreen = nscreen - 1;
-    if (screen_arg > lastscreen) /* invalid screen specified? */
-      errorargscreen(nscreen);
-    else if (screen_arg >= 0) { /* screen index was specified? */
-      firstscreen = screen_arg;
-      lastscreen = screen_arg;
-    }
-    if (!flags) /* no arguments? */
-      printestimate(dpy, firstscreen, lastscreen);
+    if (!display_arg) /* (on 'DISPLAY') */
+      runx(argc, argv, flags, ts);
+    else if ((flags & has_b) && !batch_arg && strchr(display_arg, ','))
+      logerror("--batch needs a FILE with several displays");
     else
-      processargs(dpy, flags, firstscreen, lastscreen, ts);
-    XCloseDisplay(dpy);
+      fanout(display_arg, argc, argv, flags, ts);
   }
   return (fail) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,516 @@
+/*
+** test.c
+** Regression tests of xsct against a mock gamma backend
+** Public domain
+*/
+
+#define main  xsct_main
+#include "xsct.c"
+#undef main
+
+
+/*
+** Mock backend. One screen with 'MOCK_CRTCS' active CRTCs of the ramp
+** sizes in 'mocksize', whose ramps and end point cache live in 'mock'
+** (so they survive between invocations, as on a server; the cache is
+** read as 'readprop' reads 'XSCT_PROPERTY'). Every call that
+** would wait for the server (one per call, as the XRandR backend batches
+** the CRTCs of a call) counts as a round trip. As in 'xrrcrtcs', the
+** CRTC infos and the cache are requested along with the resources, so
+** collecting them costs one only if nothing was waited for since.
+*/
+
+#define MOCK_CRTCS    4
+#define MOCK_SIZEMAX  4096
+
+static const int mocksize[MOCK_CRTCS] = { 1024, 1024, 256, 4096 };
+
+static struct {
+  unsigned short ramp[MOCK_CRTCS][3][MOCK_SIZEMAX];
+  int cached[MOCK_CRTCS];           /* has an entry in the cache */
+  crtcstate cache[MOCK_CRTCS];      /* cached end points, hash and state */
+  int stale;                        /* the configuration changed */
+  int inflight;                     /* CRTC infos and cache on their way */
+  int locked;                       /* within a grab */
+  unsigned long rt;                 /* round trips */
+  unsigned long lockedrt;           /* round trips within a grab */
+  unsigned long nlock;              /* grabs */
+  unsigned long nset;               /* ramps set */
+  unsigned long nread;              /* ramps read */
+} mock;
+
+
+static int mocknscreen (Display *dpy) {
+  (void)dpy; /* unused */
+  return 1;
+}
+
+
+static void mockcrtcs (Display *dpy, scrctx *sc, int iscreen) {
+  (void)dpy; (void)iscreen; /* unused */
+  sc->ncrtc = MOCK_CRTCS;
+  mock.rt++; /* (screen resources) */
+  mock.inflight = 1;
+}
+
+
+/* wait for the server ('inflight' replies arrive along) */
+static void mockwait (int need) {
+  if (need) {
+    mock.rt++;
+    mock.lockedrt += (unsigned long)mock.locked;
+  }
+  mock.inflight = 0;
+}
+
+
+static void mockinfo (Display *dpy, scrctx *sc) {
+  (void)dpy; /* unused */
+  sc->nlive = 0;
+  for (int c = 0; c < sc->ncrtc; c++) {
+    sc->crtc[c].mode = (RRMode)(c + 1);
+    sc->crtc[c].active = 1;
+    sc->live[sc->nlive++] = c;
+  }
+  mockwait(mock.inflight); /* (CRTC infos) */
+}
+
+
+static void mocksizes (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  int n = 0;
+  (void)dpy; /* unused */
+  for (int i = 0; i < ncrtc; i++)
+    if (sc->crtc[ic[i]].gammasize == 0) {
+      sc->crtc[ic[i]].gammasize = mocksize[ic[i]];
+      n++;
+    }
+  if (n > 0)
+    mockwait(1);
+}
+
+
+static void mockramps (Display *dpy, scrctx *sc, const int *ic, int ncrtc) {
+  int n = 0;
+  (void)dpy; /* unused */
+  for (int i = 0; i < ncrtc; i++) {
+    int c = ic[i];
+    if (!sc->crtc[c].known) { /* (with its size, as in 'xrrramps') */
+      setlast(sc, c, mocksize[c], mock.ramp[c][0], mock.ramp[c][1],
+              mock.ramp[c][2]);
+      mock.nread++;
+      n++;
+    }
+  }
+  if (n > 0)
+    mockwait(1);
+}
+
+
+static void mockset (Display *dpy, scrctx *sc, int c,
+                     XRRCrtcGamma *xrr_gamma) {
+  (void)dpy; (void)sc; /* unused */
+  if (xrr_gamma->size != mocksize[c]) {
+    fprintf(stderr, "CRTC %d: ramp of %d entries for size %d\n", c,
+            xrr_gamma->size, mocksize[c]);
+    fail = 1;
+    return;
+  }
+  memcpy(mock.ramp[c][0], xrr_gamma->red, sizeof(unsigned short) *
+         (size_t)xrr_gamma->size);
+  memcpy(mock.ramp[c][1], xrr_gamma->green, sizeof(unsigned short) *
+         (size_t)xrr_gamma->size);
+  memcpy(mock.ramp[c][2], xrr_gamma->blue, sizeof(unsigned short) *
+         (size_t)xrr_gamma->size);
+  mock.nset++;
+}
+
+
+static void mocknop (Display *dpy) {
+  (void)dpy; /* unused */
+}
+
+
+static int mockoutputs (Display *dpy, scrctx *sc, outinfo **out) {
+  (void)dpy; (void)sc; /* unused */
+  *out = NULL;
+  return 0; /* (no outputs, so no calibrations) */
+}
+
+
+static double mockrefresh (scrctx *sc, int c) {
+  (void)sc; (void)c; /* unused */
+  return 1000.0; /* (short fades) */
+}
+
+
+static int mockvblank (Display *dpy, scrctx *sc) {
+  (void)dpy; (void)sc; /* unused */
+  return 0; /* (paced by the timer) */
+}
+
+
+static int mockvblanked (Display *dpy, scrctx *sc) {
+  (void)dpy; (void)sc; /* unused */
+  return 0;
+}
+
+
+static int mockfd (Display *dpy) {
+  (void)dpy; /* unused */
+  return -1;
+}
+
+
+static void mockreadcache (Display *dpy, scrctx *sc) {
+  int fresh = !mock.stale;
+  (void)dpy; /* unused */
+  sc->propread = 1;
+  if (fresh && sc->probe >= 0 && mock.cached[sc->probe]) { /* (as 'readprop') */
+    const crtcstate *cs = &sc->crtc[sc->probe];
+    const crtcstate *e = &mock.cache[sc->probe];
+    fresh = (cs->known && memcmp(cs->last, e->last, sizeof(cs->last)) == 0 &&
+             cs->hash == e->hash);
+  }
+  sc->probe = -1;
+  for (int c = 0; c < sc->ncrtc; c++) {
+    crtcstate *cs = &sc->crtc[c];
+    const crtcstate *e = &mock.cache[c];
+    if (mock.cached[c] && cs->sthash == 0) {
+      cs->st = e->st;
+      cs->sthash = e->sthash;
+    }
+    if (mock.cached[c] && !cs->known && fresh) {
+      cs->gammasize = mocksize[c];
+      memcpy(cs->last, e->last, sizeof(cs->last));
+      cs->hash = e->hash;
+      cs->known = 1;
+    }
+  }
+  mockwait(mock.inflight);
+}
+
+
+static void mockwritecache (Display *dpy, scrctx *sc) {
+  if (!sc->propread) /* (as 'writeprop') */
+    mockreadcache(dpy, sc);
+  for (int c = 0; c < sc->ncrtc; c++) {
+    const crtcstate *cs = &sc->crtc[c];
+    crtcstate *e = &mock.cache[c];
+    mock.cached[c] = cs->known && !cs->fading; /* (as 'writeprop') */
+    memcpy(e->last, cs->last, sizeof(e->last));
+    e->hash = cs->hash;
+    e->sthash = hasst(cs) ? cs->hash : 0;
+    e->st = cs->st;
+  }
+  mock.stale = 0;
+}
+
+
+static void mocklock (Display *dpy) {
+  (void)dpy; /* unused */
+  mock.locked = 1;
+  mock.nlock++;
+}
+
+
+static void mockunlock (Display *dpy) {
+  (void)dpy; /* unused */
+  mock.locked = 0;
+}
+
+
+static void mocknopctx (Display *dpy, scrctx *sc) {
+  (void)dpy; (void)sc; /* unused */
+}
+
+
+static const backend mockbackend = {
+  mocknscreen, mockcrtcs, mockinfo, mocksizes, mockramps, mockset, mocknop,
+  mockoutputs, mockrefresh, mockvblank, mockvblanked, mockfd, mockreadcache,
+  mockwritecache, mocklock, mockunlock, mocknopctx
+};
+
+
+static int nfailed = 0;   /* failed checks */
+static char *errlog;      /* what was logged ('ferr') since 'checklog' */
+static size_t errlen;
+
+
+static void check (int ok, const char *fmt, ...) {
+  va_list ap;
+  if (ok)
+    return;
+  nfailed++;
+  va_start(ap, fmt);
+  fprintf(stderr, "FAIL: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+}
+
+
+/*
+** Check that what 'what' logged holds 'expect', or that nothing was logged
+** if 'expect' is 'NULL', and clear the log.
+*/
+static void checklog (const char *what, const char *expect) {
+  fflush(ferr);
+  if (expect)
+    check(strstr(errlog, expect) != NULL, "'%s' did not log \"%s\"", what,
+          expect);
+  else
+    check(errlen == 0, "'%s' logged: %s", what, errlog);
+  fseeko(ferr, 0, SEEK_SET);
+  fflush(ferr); /* (size of 'errlog' is the position) */
+  errlog[0] = '\0';
+}
+
+
+/*
+** Run 'args' (a space-separated command line) as a fresh invocation that
+** logs 'expect' (see 'checklog').
+*/
+static void oplog (const char *args, const char *expect) {
+  tempstate ts = { .temp = MIN_DELTA, .brightness = MIN_DELTA };
+  const char *argv[16];
+  char buf[256];
+  unsigned flags;
+  int argc = 0;
+  snprintf(buf, sizeof(buf), "xsct %s", args);
+  for (char *p = strtok(buf, " "); p && argc < 16; p = strtok(NULL, " "))
+    argv[argc++] = p;
+  fail = 0;
+  atomic = force = 0;
+  crtc_arg = screen_arg = -1;
+  fade_ms = 0;
+  ease = EASE_SMOOTH;
+  gamma_arg = 0.0;
+  temp_day = TEMP_NORM;
+  temp_night = TEMP_NIGHT;
+  flags = collectargs(argc, argv, &ts);
+  check(!fail && !(flags & has_h), "'%s' failed", args);
+  run(NULL, flags, ts);
+  runfades(NULL);
+  freectxs(NULL);
+  freeramps();
+  checklog(args, expect);
+}
+
+
+/* run 'args' as a fresh invocation that logs nothing */
+static void op (const char *args) {
+  oplog(args, NULL);
+}
+
+
+/* estimate of a fresh invocation (from the cache if 'cached') */
+static tempstate estimate (int cached) {
+  tempstate ts;
+  if (!cached)
+    memset(mock.cached, 0, sizeof(mock.cached));
+  ts = knownst(NULL, getctx(NULL, 0), -1);
+  freectxs(NULL);
+  checklog("(estimate)", NULL);
+  return ts;
+}
+
+
+/* costs of 'args' as round trips, ramps set and ramps read */
+static void cost (const char *args, unsigned long *rt, unsigned long *nset,
+                  unsigned long *nread) {
+  unsigned long rt0 = mock.rt, nset0 = mock.nset, nread0 = mock.nread;
+  op(args);
+  *rt = mock.rt - rt0;
+  *nset = mock.nset - nset0;
+  *nread = mock.nread - nread0;
+}
+
+
+/*
+** The estimate of a set temperature and brightness is close to it. Below
+** the temperature at which green reaches 0 the ramps have only red, as
+** at MINTEMP, which is the estimate then.
+*/
+static void testroundtrip (void) {
+  static const double bs[] = { 1.0, 0.7, 0.3 };
+  for (int k = 0; k < (int)(sizeof(bs) / sizeof(bs[0])); k++) {
+    for (long temp = MINTEMP; temp <= 20000; temp += 100) {
+      char args[64];
+      snprintf(args, sizeof(args), "%ld %g", temp, bs[k]);
+      op(args);
+      for (int cached = 1; cached >= 0; cached--) {
+        tempstate ts = estimate(cached);
+        /* (the cache has the state, the ramps invert to about 1%) */
+        long want = (cached || tempgamma(temp).green > 0.0) ? temp : MINTEMP;
+        check(labs(ts.temp - want) <= want / 100 + TEMPLUT_STEP,
+              "%s: estimated %ldK from the %s", args, ts.temp,
+              cached ? "cache" : "ramps");
+        check(fabs(ts.brightness - bs[k]) < 1e-3,
+              "%s: estimated brightness %g from the %s", args, ts.brightness,
+              cached ? "cache" : "ramps");
+      }
+    }
+  }
+  op("0");
+  check(estimate(1).temp == TEMP_NORM, "'xsct 0' is not %dK", TEMP_NORM);
+}
+
+
+/* brightness 0 and deltas to 0K reset the temperature (see "Quirks") */
+static void testquirk (void) {
+  tempstate ts;
+  op("3000 0.5");
+  oplog("-d 0 -0.6", "brightness values below 0.0"); /* (to below 0) */
+  ts = estimate(1);
+  check(ts.brightness == 0.0, "brightness %g after going below 0",
+        ts.brightness);
+  oplog("-d 0 0.4", "temperatures of 0 and below");
+  ts = estimate(1);
+  check(ts.temp == TEMP_NORM && fabs(ts.brightness - 0.4) < 1e-3,
+        "%ldK %g after dimming to 0 and back (expected %dK 0.4)", ts.temp,
+        ts.brightness, TEMP_NORM);
+  op("3000");
+  oplog("-d -5000 0", "temperatures of 0 and below"); /* (like 'xsct 0') */
+  ts = estimate(1);
+  check(ts.temp == TEMP_NORM, "%ldK after a delta to below 0K (expected %dK)",
+        ts.temp, TEMP_NORM);
+}
+
+
+/*
+** The estimate after a set is exactly what was set, also after a
+** configuration change, unless another program changed the ramps.
+*/
+static void testexact (void) {
+  tempstate ts;
+  op("4321 0.61");
+  ts = estimate(1);
+  check(ts.temp == 4321 && ts.brightness == 0.61,
+        "estimated %ldK %g from the cache (expected 4321K 0.61)", ts.temp,
+        ts.brightness);
+  op("-d 11 -0.01");
+  mock.stale = 1;
+  ts = estimate(1);
+  check(ts.temp == 4332 && ts.brightness == 0.61 - 0.01,
+        "estimated %ldK %g from unchanged ramps (expected 4332K 0.6)",
+        ts.temp, ts.brightness);
+  for (int c = 0; c < MOCK_CRTCS; c++) /* (another program sets them) */
+    for (int i = 0; i < mocksize[c]; i++)
+      mock.ramp[c][0][i] = mock.ramp[c][1][i] = mock.ramp[c][2][i] =
+        (unsigned short)(i * 32768 / mocksize[c]);
+  for (int stale = 0; stale <= 1; stale++) {
+    mock.stale = stale;
+    ts = estimate(1);
+    check(labs(ts.temp - TEMP_NORM) <= TEMP_NORM / 100 &&
+          fabs(ts.brightness - 0.5) < 1e-3,
+          "estimated %ldK %g from changed ramps%s (expected %dK 0.5)",
+          ts.temp, ts.brightness, stale ? " and configuration" : "",
+          TEMP_NORM);
+  }
+}
+
+
+/* a set is skipped only if the CRTCs really have the ramps */
+static void testskip (void) {
+  unsigned long rt, nset, nread;
+  op("4500");
+  cost("4500", &rt, &nset, &nread);
+  check(nset == 0, "set %lu ramps of an unchanged 4500K", nset);
+  for (int c = 0; c < MOCK_CRTCS; c++) /* (another program sets them) */
+    mock.ramp[c][1][mocksize[c] / 2] ^= 1;
+  cost("4500", &rt, &nset, &nread);
+  check(nset == MOCK_CRTCS, "set %lu ramps after another program (expected "
+        "%d)", nset, MOCK_CRTCS);
+  cost("--force 4500", &rt, &nset, &nread);
+  check(nset == MOCK_CRTCS, "set %lu ramps with --force (expected %d)", nset,
+        MOCK_CRTCS);
+}
+
+
+/*
+** '--atomic' takes one grab for all CRTCs, also when they get different
+** states, and nothing within it waits for the server.
+*/
+static void testatomic (void) {
+  static const char *const args[] = { "--atomic 5000", "--atomic -d -100 0",
+                                      "--atomic -t" };
+  for (int i = 0; i < (int)(sizeof(args) / sizeof(args[0])); i++) {
+    unsigned long rt, nset, nread;
+    unsigned long nlock = mock.nlock, lockedrt = mock.lockedrt;
+    op("-c 0 3000"); /* (different states) */
+    op("-c 1 4000");
+    cost(args[i], &rt, &nset, &nread);
+    check(mock.nlock - nlock == 1 && mock.lockedrt == lockedrt &&
+          nset == MOCK_CRTCS, "'%s' took %lu grabs with %lu round trips "
+          "in them for %lu ramps", args[i], mock.nlock - nlock,
+          mock.lockedrt - lockedrt, nset);
+  }
+}
+
+
+/* a fade ends at its target */
+static void testfade (void) {
+  tempstate ts;
+  op("6500");
+  op("-f 50 --ease smooth 3000 0.8");
+  ts = estimate(0);
+  check(labs(ts.temp - 3000) <= 30 + TEMPLUT_STEP &&
+        fabs(ts.brightness - 0.8) < 1e-3, "fade ended at %ldK %g", ts.temp,
+        ts.brightness);
+}
+
+
+/*
+** Round trips, ramps set and ramps read of the common commands on one
+** screen with 'MOCK_CRTCS' CRTCs, starting with the cache in place. The
+** budgets are the costs when they were written; more is a regression.
+*/
+static void testbudget (void) {
+  static const struct {
+    const char *args;
+    unsigned long rt, nset, nread;   /* budgets */
+  } ops[] = {
+    { "4500", 2, MOCK_CRTCS, 1 },
+    { "4500", 2, 0, 1 },            /* (already set, probe only) */
+    { "-d -100 0", 2, MOCK_CRTCS, 1 },
+    { "-t", 2, MOCK_CRTCS, 1 },
+    { "", 2, 0, 1 },                /* (estimate) */
+    { "-c 2 5000", 2, 1, 1 },
+  };
+  op("6500");
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+    unsigned long rt, nset, nread;
+    cost(ops[i].args, &rt, &nset, &nread);
+    printf("  %-12s %2lu round trips %2lu ramps set %2lu read\n",
+           ops[i].args[0] ? ops[i].args : "(estimate)", rt, nset, nread);
+    check(rt <= ops[i].rt, "'%s' took %lu round trips (budget %lu)",
+          ops[i].args, rt, ops[i].rt);
+    check(nset <= ops[i].nset, "'%s' set %lu ramps (budget %lu)",
+          ops[i].args, nset, ops[i].nset);
+    check(nread <= ops[i].nread, "'%s' read %lu ramps (budget %lu)",
+          ops[i].args, nread, ops[i].nread);
+  }
+}
+
+
+int main (void) {
+  fout = fopen("/dev/null", "w"); /* (estimates) */
+  ferr = open_memstream(&errlog, &errlen);
+  if (fout == NULL || ferr == NULL) {
+    fprintf(stderr, "cannot open the test outputs\n");
+    return EXIT_FAILURE;
+  }
+  setenv("XDG_CONFIG_HOME", "/nonexistent", 1); /* (no calibrations) */
+  unsetenv(XSCT_TEMPERATURE_DAY);
+  unsetenv(XSCT_TEMPERATURE_NIGHT);
+  be = &mockbackend;
+  testroundtrip();
+  testquirk();
+  testexact();
+  testskip();
+  testatomic();
+  testfade();
+  testbudget();
+  printf("%s (%d failed)\n", nfailed ? "FAIL" : "ok", nfailed);
+  return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}